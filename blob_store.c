@@ -0,0 +1,261 @@
+#include "blob_store.h"
+#include "log.h"
+#include "md5.h"
+#include "utils.h"
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <zlib.h>
+
+// Each file is:
+//   magic, u32 key length, key, exec flag byte, u64 content length
+//   the content, zlib compressed.
+// The key is checked on reading, so an MD5 collision is just a miss.
+#define MAGIC "crapblob"
+#define MAGIC_LEN 8
+
+typedef struct stored_file {
+    char * path;
+    struct timespec mtime;
+    off_t size;
+} stored_file_t;
+
+
+void blob_store_init (blob_store_t * store, const char * dir,
+                      const char * keyword_mode, unsigned long long limit)
+{
+    store->dir = dir;
+    store->keyword_mode = keyword_mode;
+    store->limit = limit;
+    store->hits = 0;
+    store->stored = 0;
+
+    if (mkdir (dir, 0777) != 0 && errno != EEXIST)
+        warning ("Creating %s failed: %s\n", dir, strerror (errno));
+}
+
+
+static char * blob_key (const blob_store_t * store,
+                        const char * rcs_path, const char * version)
+{
+    return xasprintf ("%s %s %s", store->keyword_mode, version, rcs_path);
+}
+
+
+/// The file for @c key; if @c subdir is not NULL, also the directory it is in.
+static char * blob_path (const blob_store_t * store, const char * key,
+                         char ** subdir)
+{
+    unsigned char digest[16];
+    md5 (key, strlen (key), digest);
+    char hex[33];
+    for (int i = 0; i != 16; ++i)
+        sprintf (hex + 2 * i, "%02x", digest[i]);
+
+    if (subdir != NULL)
+        *subdir = xasprintf ("%s/%.2s", store->dir, hex);
+    return xasprintf ("%s/%.2s/%s", store->dir, hex, hex + 2);
+}
+
+
+/// Check the header at @c *p is for @c key, and if so step over it, returning
+/// the exec flag and the content length.
+static bool check_header (const unsigned char ** p, const unsigned char * end,
+                          const char * key, bool * exec, uint64_t * len)
+{
+    uint32_t key_len = strlen (key);
+    uint32_t stored_key_len;
+    size_t header = MAGIC_LEN + sizeof key_len + key_len + 1 + sizeof *len;
+    if ((size_t) (end - *p) < header || memcmp (*p, MAGIC, MAGIC_LEN) != 0)
+        return false;
+
+    const unsigned char * q = *p + MAGIC_LEN;
+    memcpy (&stored_key_len, q, sizeof stored_key_len);
+    q += sizeof stored_key_len;
+    if (stored_key_len != key_len || memcmp (q, key, key_len) != 0)
+        return false;
+    q += key_len;
+
+    *exec = *q++ != 0;
+    memcpy (len, q, sizeof *len);
+    *p = q + sizeof *len;
+    return true;
+}
+
+
+bool blob_store_get (blob_store_t * store,
+                     const char * rcs_path, const char * version,
+                     char ** data, size_t * len, bool * exec)
+{
+    char * key = blob_key (store, rcs_path, version);
+    char * path = blob_path (store, key, NULL);
+    bool found = false;
+
+    int fd = open (path, O_RDONLY);
+    struct stat st;
+    void * map = MAP_FAILED;
+    if (fd >= 0 && fstat (fd, &st) == 0 && st.st_size > 0)
+        map = mmap (NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+
+    if (map != MAP_FAILED) {
+        const unsigned char * p = map;
+        const unsigned char * end = p + st.st_size;
+        uint64_t content_len;
+        if (check_header (&p, end, key, exec, &content_len)) {
+            uLongf out_len = content_len;
+            char * out = xmalloc (content_len + 1);
+            if (uncompress ((Bytef *) out, &out_len, p, end - p) == Z_OK
+                && out_len == content_len) {
+                *data = out;
+                *len = content_len;
+                found = true;
+                ++store->hits;
+                // Keep it recently used.
+                futimens (fd, NULL);
+            }
+            else {
+                warning ("Ignoring damaged blob store file %s\n", path);
+                xfree (out);
+            }
+        }
+        munmap (map, st.st_size);
+    }
+
+    if (fd >= 0)
+        close (fd);
+    xfree (path);
+    xfree (key);
+    return found;
+}
+
+
+void blob_store_put (blob_store_t * store,
+                     const char * rcs_path, const char * version,
+                     const char * data, size_t len, bool exec)
+{
+    char * key = blob_key (store, rcs_path, version);
+    char * subdir;
+    char * path = blob_path (store, key, &subdir);
+    char * temp = xasprintf ("%s.%d", path, getpid());
+
+    uLongf packed_len = compressBound (len);
+    Bytef * packed = xmalloc (packed_len);
+    if (compress2 (packed, &packed_len, (const Bytef *) data, len,
+                   Z_DEFAULT_COMPRESSION) != Z_OK)
+        fatal ("Compressing %s %s failed\n", rcs_path, version);
+
+    if (mkdir (subdir, 0777) != 0 && errno != EEXIST)
+        warning ("Creating %s failed: %s\n", subdir, strerror (errno));
+
+    FILE * out = fopen (temp, "w");
+    if (out == NULL)
+        warning ("Opening %s failed: %s\n", temp, strerror (errno));
+    else {
+        uint32_t key_len = strlen (key);
+        uint64_t content_len = len;
+        char e = exec;
+        fwrite (MAGIC, MAGIC_LEN, 1, out);
+        fwrite (&key_len, sizeof key_len, 1, out);
+        fwrite (key, key_len, 1, out);
+        fwrite (&e, 1, 1, out);
+        fwrite (&content_len, sizeof content_len, 1, out);
+        fwrite (packed, packed_len, 1, out);
+        if (ferror (out) | (fclose (out) != 0)) {
+            warning ("Writing %s failed\n", temp);
+            unlink (temp);
+        }
+        else if (rename (temp, path) != 0) {
+            warning ("Renaming %s failed: %s\n", temp, strerror (errno));
+            unlink (temp);
+        }
+        else
+            ++store->stored;
+    }
+
+    xfree (packed);
+    xfree (temp);
+    xfree (path);
+    xfree (subdir);
+    xfree (key);
+}
+
+
+static int compare_mtime (const void * AA, const void * BB)
+{
+    const stored_file_t * A = AA;
+    const stored_file_t * B = BB;
+    if (A->mtime.tv_sec != B->mtime.tv_sec)
+        return A->mtime.tv_sec < B->mtime.tv_sec ? -1 : 1;
+    if (A->mtime.tv_nsec != B->mtime.tv_nsec)
+        return A->mtime.tv_nsec < B->mtime.tv_nsec ? -1 : 1;
+    return 0;
+}
+
+
+void blob_store_trim (blob_store_t * store)
+{
+    if (store->limit == 0)
+        return;
+
+    DIR * top = opendir (store->dir);
+    if (top == NULL) {
+        warning ("Opening %s failed: %s\n", store->dir, strerror (errno));
+        return;
+    }
+
+    stored_file_t * files = NULL;
+    stored_file_t * files_end = NULL;
+    unsigned long long total = 0;
+    struct dirent * d;
+    while ((d = readdir (top)) != NULL) {
+        if (strlen (d->d_name) != 2 || d->d_name[0] == '.')
+            continue;
+        char * subdir = xasprintf ("%s/%s", store->dir, d->d_name);
+        DIR * sub = opendir (subdir);
+        struct dirent * e;
+        while (sub != NULL && (e = readdir (sub)) != NULL) {
+            char * path = xasprintf ("%s/%s", subdir, e->d_name);
+            struct stat st;
+            if (e->d_name[0] == '.' || stat (path, &st) != 0
+                || !S_ISREG (st.st_mode)) {
+                xfree (path);
+                continue;
+            }
+            ARRAY_EXTEND (files);
+            files_end[-1].path = path;
+            files_end[-1].mtime = st.st_mtim;
+            files_end[-1].size = st.st_size;
+            total += st.st_size;
+        }
+        if (sub != NULL)
+            closedir (sub);
+        xfree (subdir);
+    }
+    closedir (top);
+
+    size_t evicted = 0;
+    if (total > store->limit) {
+        qsort (files, files_end - files, sizeof (stored_file_t),
+               compare_mtime);
+        for (stored_file_t * i = files;
+             i != files_end && total > store->limit; ++i)
+            if (unlink (i->path) == 0) {
+                total -= i->size;
+                ++evicted;
+            }
+    }
+
+    if (evicted != 0)
+        fprintf (stderr, "Evicted %zu blobs from the blob store.\n", evicted);
+
+    for (stored_file_t * i = files; i != files_end; ++i)
+        xfree (i->path);
+    xfree (files);
+}
@@ -0,0 +1,44 @@
+#ifndef BLOB_STORE_H
+#define BLOB_STORE_H
+
+/// @file
+/// A local store of file version content, so that importing the same CVS
+/// repository into a fresh git repository need not fetch everything again.
+///
+/// Each blob is a zlib-compressed file, named by the MD5 of its key: the
+/// keyword mode, the ,v path and the version.  A blob read is touched, so
+/// that its modification time gives least-recently-used order for eviction.
+
+#include <stdbool.h>
+#include <stddef.h>
+
+typedef struct blob_store {
+    const char * dir;
+    const char * keyword_mode;
+    unsigned long long limit;           ///< Bytes; 0 for no limit.
+    size_t hits;
+    size_t stored;
+} blob_store_t;
+
+/// Set up the store in @c dir, for blobs with keyword mode @c keyword_mode,
+/// keeping it to @c limit bytes (0 for no limit).
+void blob_store_init (blob_store_t * store, const char * dir,
+                      const char * keyword_mode, unsigned long long limit);
+
+/// Look up version @c version of the ,v file @c rcs_path.  If found, returns
+/// true, with a malloc'd copy of the content in @c data and @c len, and the
+/// executable flag in @c exec.
+bool blob_store_get (blob_store_t * store,
+                     const char * rcs_path, const char * version,
+                     char ** data, size_t * len, bool * exec);
+
+/// Store the content of version @c version of @c rcs_path.  Failure is not
+/// fatal, we just warn.
+void blob_store_put (blob_store_t * store,
+                     const char * rcs_path, const char * version,
+                     const char * data, size_t len, bool exec);
+
+/// Evict the least recently used blobs to bring the store within its limit.
+void blob_store_trim (blob_store_t * store);
+
+#endif
@@ -0,0 +1,216 @@
+// LD_PRELOAD library for the local cvs server, coalescing its many small
+// writes to stdout into large ones.
+//
+// Output to fd 1 is held in a buffer, and written out when the buffer fills,
+// and before anything that might wait for our peer: reading, select() and
+// poll(), and before fork() and exit.  Everything else passes straight through.
+//
+// If writing out the buffer fails, the call that caused the flush fails with
+// the write's errno, and so does every later write to fd 1, so that the server
+// still sees EPIPE or EIO when its client has gone.
+
+#include <dlfcn.h>
+#include <errno.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/select.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#define BUFFER_SIZE 65536
+#define BUFFERED_FD 1
+
+static char buffer[BUFFER_SIZE];
+static size_t buffered;
+static int write_error;                 ///< errno of a failed flush, or 0.
+
+
+static void * lookup (const char * name)
+{
+    void * f = dlsym (RTLD_NEXT, name);
+    if (f == NULL)
+        abort();
+    return f;
+}
+
+
+/// Call the real version of function @c name, of type @c T.
+#define REAL(T, name) ({                                \
+            static T real;                              \
+            if (real == NULL)                           \
+                real = (T) lookup (#name);              \
+            real; })
+
+typedef ssize_t write_t (int, const void *, size_t);
+typedef ssize_t read_t (int, void *, size_t);
+typedef ssize_t iov_t (int, const struct iovec *, int);
+typedef int select_t (int, fd_set *, fd_set *, fd_set *, struct timeval *);
+typedef int pselect_t (int, fd_set *, fd_set *, fd_set *,
+                       const struct timespec *, const sigset_t *);
+typedef int poll_t (struct pollfd *, nfds_t, int);
+typedef int fd_func_t (int);
+typedef int dup2_t (int, int);
+typedef pid_t fork_t (void);
+typedef void exit_t (int);
+
+
+/// Write all of [@c p, @c p + @c len) to @c fd.  On error, the data is
+/// dropped, the error is remembered for later writes, and false is returned
+/// with errno set.
+static bool write_all (int fd, const char * p, size_t len)
+{
+    while (len != 0) {
+        ssize_t r = REAL (write_t *, write) (fd, p, len);
+        if (r > 0) {
+            p += r;
+            len -= r;
+            continue;
+        }
+        if (r == 0)
+            errno = EIO;
+        else if (errno == EINTR || errno == EAGAIN)
+            continue;
+        write_error = errno;
+        return false;
+    }
+    return true;
+}
+
+
+/// Write out the buffer.  Returns false with errno set if that fails, now or
+/// before.
+static bool flush (void)
+{
+    if (write_error != 0) {
+        buffered = 0;
+        errno = write_error;
+        return false;
+    }
+
+    size_t len = buffered;
+    buffered = 0;
+    return len == 0 || write_all (BUFFERED_FD, buffer, len);
+}
+
+
+static void __attribute__ ((destructor)) flush_at_exit (void)
+{
+    flush();
+}
+
+
+ssize_t write (int fd, const void * data, size_t len)
+{
+    if (fd != BUFFERED_FD)
+        return REAL (write_t *, write) (fd, data, len);
+
+    if ((write_error != 0 || buffered + len > BUFFER_SIZE) && !flush())
+        return -1;
+    if (len >= BUFFER_SIZE) {
+        if (!write_all (fd, data, len))
+            return -1;
+    }
+    else {
+        memcpy (buffer + buffered, data, len);
+        buffered += len;
+    }
+    return len;
+}
+
+
+ssize_t writev (int fd, const struct iovec * iov, int count)
+{
+    if (fd == BUFFERED_FD && !flush())
+        return -1;
+    return REAL (iov_t *, writev) (fd, iov, count);
+}
+
+
+ssize_t read (int fd, void * data, size_t len)
+{
+    if (!flush())
+        return -1;
+    return REAL (read_t *, read) (fd, data, len);
+}
+
+
+ssize_t readv (int fd, const struct iovec * iov, int count)
+{
+    if (!flush())
+        return -1;
+    return REAL (iov_t *, readv) (fd, iov, count);
+}
+
+
+int select (int n, fd_set * r, fd_set * w, fd_set * e, struct timeval * t)
+{
+    if (!flush())
+        return -1;
+    return REAL (select_t *, select) (n, r, w, e, t);
+}
+
+
+int pselect (int n, fd_set * r, fd_set * w, fd_set * e,
+             const struct timespec * t, const sigset_t * mask)
+{
+    if (!flush())
+        return -1;
+    return REAL (pselect_t *, pselect) (n, r, w, e, t, mask);
+}
+
+
+int poll (struct pollfd * fds, nfds_t n, int timeout)
+{
+    if (!flush())
+        return -1;
+    return REAL (poll_t *, poll) (fds, n, timeout);
+}
+
+
+int fsync (int fd)
+{
+    if (fd == BUFFERED_FD && !flush())
+        return -1;
+    return REAL (fd_func_t *, fsync) (fd);
+}
+
+
+int close (int fd)
+{
+    if (fd != BUFFERED_FD || flush())
+        return REAL (fd_func_t *, close) (fd);
+
+    // Close anyway, but report the lost output, as close() does for a
+    // deferred write error.
+    int error = errno;
+    REAL (fd_func_t *, close) (fd);
+    errno = error;
+    return -1;
+}
+
+
+int dup2 (int old, int new)
+{
+    if (new == BUFFERED_FD && !flush())
+        return -1;
+    return REAL (dup2_t *, dup2) (old, new);
+}
+
+
+pid_t fork (void)
+{
+    // A failure is not fork's to report; the next write to fd 1 reports it.
+    flush();
+    return REAL (fork_t *, fork) ();
+}
+
+
+void _exit (int status)
+{
+    flush();
+    REAL (exit_t *, _exit) (status);
+    abort();
+}
@@ -1,4 +1,5 @@
 #include "cvs_connection.h"
+#include "blob_store.h"
 #include "branch.h"
 #include "changeset.h"
 #include "database.h"
@@ -6,26 +7,52 @@
 #include "file.h"
 #include "filter.h"
 #include "fixup.h"
+#include "keywords.h"
 #include "log.h"
 #include "log_parse.h"
+#include "md5.h"
+#include "rcs.h"
+#include "sha1.h"
 #include "string_cache.h"
 #include "utils.h"
+#include "version_cache.h"
 
 #include <assert.h>
+#include <dirent.h>
 #include <errno.h>
 #include <fcntl.h>
 #include <getopt.h>
 #include <limits.h>
 #include <pipeline.h>
+#include <poll.h>
+#include <pthread.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <sys/inotify.h>
 #include <sys/stat.h>
 #include <time.h>
+#include <unistd.h>
 
 enum {
     opt_fuzz_span = 256,
     opt_fuzz_gap,
+    opt_rcs,
+    opt_window,
+    opt_buffer_size,
+    opt_deltas,
+    opt_lookahead,
+    opt_blobs_first,
+    opt_fetch_thread,
+    opt_no_preload,
+    opt_no_snapshot,
+    opt_no_commit_cache,
+    opt_blob_store,
+    opt_blob_store_limit,
+    opt_local_keywords,
+    opt_checkpoint,
+    opt_resume,
+    opt_watch,
 };
 
 static const struct option opts[] = {
@@ -35,6 +62,7 @@ static const struct option opts[] = {
     { "filter",        required_argument, NULL, 'F' },
     { "force",         no_argument,       NULL, 'f' },
     { "help",          no_argument,       NULL, 'h' },
+    { "jobs",          required_argument, NULL, 'j' },
     { "master",        required_argument, NULL, 'm' },
     { "output",        required_argument, NULL, 'o' },
     { "remote",        required_argument, NULL, 'r' },
@@ -44,6 +72,22 @@ static const struct option opts[] = {
     { "fuzz-span",     required_argument, NULL, opt_fuzz_span },
     { "fuzz-gap",      required_argument, NULL, opt_fuzz_gap },
     { "keywords", required_argument, NULL, 'k'},
+    { "rcs",           no_argument,       NULL, opt_rcs },
+    { "window",        required_argument, NULL, opt_window },
+    { "buffer-size",   required_argument, NULL, opt_buffer_size },
+    { "deltas",        optional_argument, NULL, opt_deltas },
+    { "lookahead",     required_argument, NULL, opt_lookahead },
+    { "blobs-first",   no_argument,       NULL, opt_blobs_first },
+    { "fetch-thread",  optional_argument, NULL, opt_fetch_thread },
+    { "no-preload",    no_argument,       NULL, opt_no_preload },
+    { "no-snapshot",   no_argument,       NULL, opt_no_snapshot },
+    { "no-commit-cache", no_argument,     NULL, opt_no_commit_cache },
+    { "blob-store",    required_argument, NULL, opt_blob_store },
+    { "blob-store-limit", required_argument, NULL, opt_blob_store_limit },
+    { "local-keywords", no_argument,      NULL, opt_local_keywords },
+    { "checkpoint",    optional_argument, NULL, opt_checkpoint },
+    { "resume",        no_argument,       NULL, opt_resume },
+    { "watch",         optional_argument, NULL, opt_watch },
     { NULL, 0, NULL, 0 }
 };
 
@@ -56,6 +100,7 @@ static const char * keyword_modes[] = {
 static int keyword_mode_count = 6;
 
 static unsigned long zlevel;
+static bool zauto;
 static const char * branch_prefix;
 static const char * entries_name;
 static const char * filter_command;
@@ -65,15 +110,251 @@ static const char * output_path;
 static const char * remote = "";
 static const char * tag_prefix;
 static const char * version_cache_path;
+/// The text format version cache of older versions, to convert.
+static const char * legacy_version_cache_path;
+static version_cache_t version_cache;
+/// Guards the version cache while blobs are being sent.
+static pthread_mutex_t blob_lock = PTHREAD_MUTEX_INITIALIZER;
+/// Versions whose blob was not sent, as git already had it.
+static size_t reused_blobs;
 static const char * keyword_mode;
+/// The keyword mode asked of the server: with --local-keywords, always "o",
+/// and we expand the keywords ourselves.
+static const char * fetch_keyword_mode;
+static bool local_keywords;
+/// With --blob-store, the directory of the local store of fetched versions.
+static const char * blob_store_dir;
+static unsigned long blob_store_limit;
+static blob_store_t blob_store;
 
 static const char ** directory_list;
 static const char ** directory_list_end;
 
 static bool force;
+static bool read_rcs;
+static bool blobs_first;
+static bool no_preload;
+static bool no_snapshot;
+static bool no_commit_cache;
+/// With --rcs, the absolute path of the repository.
+static const char * rcs_root;
+
+/// For --watch: the seconds that the repository must be quiet after a change
+/// before importing again; 0 if not watching.
+static unsigned long watch_quiet;
+/// The inotify descriptor watching the module, from before the import, so
+/// that changes made during it are not missed.
+static int watch_fd = -1;
+
+/// The pool of connections used for the rlog and for fetching versions.
+static cvs_connection_t * connections;
+static cvs_connection_t * connections_end;
+static unsigned long jobs = 1;
+/// The number of update requests kept in flight on each connection.
+static unsigned long window = 1;
+/// The number of changesets to scan ahead for versions to fetch.
+static unsigned long lookahead;
 
 static size_t mark_counter;
-static size_t cached_marks;
+
+/// The commit cache: the git commit written last time for each commit
+/// identity (see @ref commit_id_start), so that the commits of unchanged
+/// history are reused instead of being written again.
+typedef struct commit_cache_item {
+    string_hash_head_t head;            ///< The identity, as hex.
+    size_t mark;                        ///< Pre-loaded into the marks file.
+} commit_cache_item_t;
+
+/// Only with git fast-import, and not --no-commit-cache.
+static bool use_commit_cache;
+static const char * commit_cache_path;
+static string_hash_t commit_cache;
+/// The identity of the commit with each mark; NULL for other marks.
+static const char ** commit_keys;
+static size_t commit_keys_size;
+/// One per tag, indexed like db->tags: has the ref been moved on by reusing
+/// commits, without git being told yet?
+static bool * stale_refs;
+static size_t reused_commits;
+
+/// For --checkpoint: the seconds between checkpoints of git fast-import; 0 for
+/// none.  At each, the identities of the commits sent so far go in the
+/// checkpoint log, so that a --resume run can reuse those that git has.
+static unsigned long checkpoint_interval;
+static bool resume;
+static const char * checkpoint_path;
+static FILE * checkpoint_log;
+/// The commit marks below this are in the checkpoint log.
+static size_t checkpoint_logged;
+
+/// For --deltas: the content of the last version of a file that we sent to
+/// git, so that the next version can be fetched as a diff against it.
+typedef struct delta_base {
+    const version_t * version;          ///< NULL if we have nothing.
+    char * text;
+    size_t len;
+    unsigned long stamp;                ///< For discarding the oldest.
+    bool sent;                  ///< Given to the server as a base, in flight.
+    bool plain;                         ///< Fetch the next version whole.
+    bool failed;                        ///< A diff against us failed.
+} delta_base_t;
+
+/// The memory budget for --deltas; zero if not in use.
+static size_t delta_budget;
+/// One per file, indexed like db->files.
+static delta_base_t * delta_bases;
+static const file_t * delta_files;
+static size_t delta_bytes;
+static unsigned long delta_clock;
+
+/// A blob read by the fetch thread, waiting to be written by the main thread.
+typedef struct fetched_blob {
+    const version_t * version;
+    char * data;
+    size_t len;
+} fetched_blob_t;
+
+/// For --fetch-thread: the fetch thread reads blobs from the CVS connections
+/// into a bounded queue, while the main thread formats the commits and writes
+/// the queued blobs to git.  Version marks are assigned by the fetch thread, and
+/// only read by the main thread once the version is seen to be fetched.
+static struct fetcher {
+    pthread_t thread;
+    bool running;
+    bool quit;                          ///< Main thread is finished with us.
+    bool finished;                      ///< Fetch thread is exiting.
+
+    pthread_mutex_t lock;
+    pthread_cond_t fetcher_wake;        ///< Space in queue, urgent, or quit.
+    pthread_cond_t main_wake;           ///< Queue has something.
+
+    fetched_blob_t * queue;
+    fetched_blob_t * queue_end;
+    size_t queue_bytes;
+    size_t queue_limit;                 ///< Zero if not in use.
+
+    /// Versions not covered by the plan, that the main thread is waiting for.
+    version_t ** urgent;
+    version_t ** urgent_end;
+
+    /// The plan; the changesets to fetch versions for, in order.
+    const database_t * db;
+    changeset_t ** serial;
+    changeset_t ** serial_end;
+} fetcher = {
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+    .fetcher_wake = PTHREAD_COND_INITIALIZER,
+    .main_wake = PTHREAD_COND_INITIALIZER,
+};
+
+
+/// Allocate a mark; the fetch thread and the main thread share the counter.
+static size_t next_mark (void)
+{
+    return __atomic_add_fetch (&mark_counter, 1, __ATOMIC_RELAXED);
+}
+
+
+/// Has @c version been fetched?  Safe to call from the main thread while the
+/// fetch thread is running.
+static bool version_fetched (const version_t * version)
+{
+    return __atomic_load_n (&version->mark, __ATOMIC_ACQUIRE) != SIZE_MAX;
+}
+
+
+/// The git blob SHA-1 of [@c data, @c data + @c len).
+static void blob_sha1 (unsigned char sha[20], const char * data, size_t len)
+{
+    sha1_t hash;
+    sha1_blob_init (&hash, len);
+    sha1_update (&hash, data, len);
+    sha1_final (&hash, sha);
+}
+
+
+/// If the blob with SHA-1 @c sha has already been sent, or is cached, then
+/// give @c version its mark and return true; the blob need not be sent.  On
+/// the fetch thread (@c out is NULL), the main thread may be waiting for
+/// @c version, with nothing queued to wake it, so wake it.
+static bool reuse_blob (FILE * out,
+                        version_t * version, const unsigned char sha[20])
+{
+    pthread_mutex_lock (&blob_lock);
+    size_t mark = version_cache_find_blob (&version_cache, sha);
+    if (mark != 0) {
+        __atomic_store_n (&version->mark, mark, __ATOMIC_RELEASE);
+        version_cache_add (&version_cache, version, sha);
+        ++reused_blobs;
+    }
+    pthread_mutex_unlock (&blob_lock);
+
+    if (mark != 0 && out == NULL) {
+        pthread_mutex_lock (&fetcher.lock);
+        pthread_cond_signal (&fetcher.main_wake);
+        pthread_mutex_unlock (&fetcher.lock);
+    }
+    return mark != 0;
+}
+
+
+/// Note that the blob for @c version, sent with its mark, has SHA-1 @c sha.
+static void record_blob (const version_t * version,
+                         const unsigned char sha[20])
+{
+    pthread_mutex_lock (&blob_lock);
+    version_cache_add (&version_cache, version, sha);
+    pthread_mutex_unlock (&blob_lock);
+}
+
+
+/// Fetch thread: give the blob for @c version, with SHA-1 @c sha, to the main
+/// thread, waiting for room in the queue.  Takes ownership of @c data.
+static void queue_blob (version_t * version, char * data, size_t len,
+                        const unsigned char sha[20])
+{
+    pthread_mutex_lock (&fetcher.lock);
+    while (fetcher.queue_bytes != 0
+           && fetcher.queue_bytes + len > fetcher.queue_limit)
+        pthread_cond_wait (&fetcher.fetcher_wake, &fetcher.lock);
+
+    ARRAY_EXTEND (fetcher.queue);
+    fetched_blob_t * b = fetcher.queue_end - 1;
+    b->version = version;
+    b->data = data;
+    b->len = len;
+    fetcher.queue_bytes += len;
+    __atomic_store_n (&version->mark, next_mark(), __ATOMIC_RELEASE);
+    record_blob (version, sha);
+
+    pthread_cond_signal (&fetcher.main_wake);
+    pthread_mutex_unlock (&fetcher.lock);
+}
+
+
+/// As @ref output_blob, but with the content in memory, still owned by the
+/// caller.
+static void output_blob_text (FILE * out, version_t * version,
+                              const char * text, size_t len)
+{
+    unsigned char sha[20];
+    blob_sha1 (sha, text, len);
+    if (reuse_blob (out, version, sha))
+        return;
+
+    if (out == NULL) {
+        char * data = xmalloc (len + 1);
+        memcpy (data, text, len);
+        queue_blob (version, data, len, sha);
+        return;
+    }
+
+    version->mark = next_mark();
+    fprintf (out, "blob\nmark :%zu\ndata %zu\n", version->mark, len);
+    fwrite (text, len, 1, out);
+    fprintf (out, "\n");
+    record_blob (version, sha);
+}
 
 // FIXME - assumes signed time_t!
 #define TIME_MIN (sizeof (time_t) == sizeof (int) ? INT_MIN : LONG_MIN)
@@ -81,8 +362,129 @@ static size_t cached_marks;
 
 static void print_fixups (FILE * out, const database_t * db,
                           version_t ** base_versions,
-                          tag_t * tag, const changeset_t * cs,
-                          cvs_connection_t * s);
+                          tag_t * tag, const changeset_t * cs);
+
+
+/// The path of @c rcs_path relative to the repository @c root, as the $CVSHeader$
+/// keyword shows it.
+static const char * root_relative (const char * root, const char * rcs_path)
+{
+    size_t root_len = strlen (root);
+    while (root_len > 0 && root[root_len - 1] == '/')
+        --root_len;
+    if (strncmp (rcs_path, root, root_len) == 0 && rcs_path[root_len] == '/')
+        return rcs_path + root_len + 1;
+    return rcs_path;
+}
+
+
+/// Output the blob for @c version, from its content @c text as fetched from
+/// the server.  With --local-keywords, that is the -ko content, and we expand
+/// the keywords from the version's own log information.
+static void output_fetched_text (FILE * out, version_t * version,
+                                 const char * text, size_t len)
+{
+    if (!local_keywords || !keywords_active (keyword_mode)) {
+        output_blob_text (out, version, text, len);
+        return;
+    }
+
+    // Only live versions are fetched, and we do not keep the state, so take
+    // the RCS default.
+    const char * rcs_path = version->file->rcs_path;
+    keyword_info_t info = {
+        .rcs_path = rcs_path,
+        .cvs_path = root_relative (connections[0].remote_root, rcs_path),
+        .version = version->version,
+        .author = version->author,
+        .state = "Exp",
+        .locker = NULL,
+        .log = version->log,
+        .log_len = strlen (version->log),
+        .time = version->time,
+    };
+
+    char * expanded = NULL;
+    size_t expanded_len = 0;
+    FILE * f = open_memstream (&expanded, &expanded_len);
+    if (f == NULL)
+        fatal ("open_memstream failed: %s\n", strerror (errno));
+    const char * end = text + len;
+    for (const char * line = text; line != end; ) {
+        const char * nl = memchr (line, '\n', end - line);
+        const char * next = nl ? nl + 1 : end;
+        keywords_expand_line (f, keyword_mode, &info, line, next - line);
+        line = next;
+    }
+    if (fclose (f) != 0)
+        fatal ("Expanding keywords failed: %s\n", strerror (errno));
+
+    output_blob_text (out, version, expanded, expanded_len);
+    free (expanded);
+}
+
+
+/// Output the blob for @c version, the next @c len bytes from @c s.  With the
+/// fetch thread, @c out is NULL, and the blob goes to the queue.
+static void output_blob (FILE * out, cvs_connection_t * s,
+                         version_t * version, size_t len)
+{
+    sha1_t hash;
+    unsigned char sha[20];
+    sha1_blob_init (&hash, len);
+
+    bool expand = local_keywords && keywords_active (keyword_mode);
+    if (out != NULL && blob_store_dir == NULL && !expand) {
+        // Streamed straight through, so sent even if git has it already.
+        // The hash is only wanted if the version cache is recording.
+        version->mark = next_mark();
+        fprintf (out, "blob\nmark :%zu\ndata %zu\n", version->mark, len);
+        if (!version_cache.record) {
+            cvs_read_block (s, out, len);
+            fprintf (out, "\n");
+            return;
+        }
+        cvs_read_block_sha1 (s, out, len, &hash);
+        fprintf (out, "\n");
+        sha1_final (&hash, sha);
+        record_blob (version, sha);
+        return;
+    }
+
+    char * data;
+    size_t data_len;
+    FILE * f = open_memstream (&data, &data_len);
+    if (f == NULL)
+        fatal ("open_memstream failed: %s\n", strerror (errno));
+    // The hash is of the content as sent, no use if we expand it.
+    cvs_read_block_sha1 (s, f, len, expand ? NULL : &hash);
+    if (fclose (f) != 0)
+        fatal ("Reading version failed: %s\n", strerror (errno));
+    if (blob_store_dir != NULL)
+        blob_store_put (&blob_store, version->file->rcs_path, version->version,
+                        data, data_len, version->exec);
+
+    if (expand) {
+        output_fetched_text (out, version, data, data_len);
+        free (data);
+        return;
+    }
+
+    sha1_final (&hash, sha);
+
+    if (reuse_blob (out, version, sha))
+        free (data);
+    else if (out == NULL)
+        queue_blob (version, data, data_len, sha);
+    else {
+        version->mark = next_mark();
+        fprintf (out, "blob\nmark :%zu\ndata %zu\n", version->mark, data_len);
+        fwrite (data, data_len, 1, out);
+        fprintf (out, "\n");
+        record_blob (version, sha);
+        free (data);
+    }
+}
 
 
 static const char * format_date (const time_t * time, bool utc)
@@ -101,9 +503,197 @@ static const char * format_date (const time_t * time, bool utc)
 }
 
 
+static delta_base_t * delta_base (const version_t * version)
+{
+    return delta_bases ? &delta_bases[version->file - delta_files] : NULL;
+}
+
+
+/// Remember @c text as the content of @c version, taking ownership.
+static void delta_store (const version_t * version, char * text, size_t len)
+{
+    delta_base_t * b = delta_base (version);
+    delta_bytes -= b->len;
+    free (b->text);
+    b->version = version;
+    b->text = text;
+    b->len = len;
+    b->stamp = ++delta_clock;
+    b->failed = false;
+    delta_bytes += len;
+}
+
+
+static int compare_delta_stamp (const void * AA, const void * BB)
+{
+    const delta_base_t * A = * (delta_base_t * const *) AA;
+    const delta_base_t * B = * (delta_base_t * const *) BB;
+    return A->stamp < B->stamp ? -1 : A->stamp > B->stamp;
+}
+
+
+/// If we are over budget, discard the oldest texts, to get well under.  Bases
+/// in flight are kept.
+static void delta_trim (const database_t * db)
+{
+    if (delta_bases == NULL || delta_bytes <= delta_budget)
+        return;
+
+    delta_base_t ** held = NULL;
+    delta_base_t ** held_end = NULL;
+    for (delta_base_t * i = delta_bases;
+         i != delta_bases + (db->files_end - db->files); ++i)
+        if (i->version && !i->sent)
+            ARRAY_APPEND (held, i);
+
+    ARRAY_SORT (held, compare_delta_stamp);
+    for (delta_base_t ** i = held;
+         i != held_end && delta_bytes > delta_budget / 4 * 3; ++i) {
+        delta_bytes -= (*i)->len;
+        free ((*i)->text);
+        (*i)->version = NULL;
+        (*i)->text = NULL;
+        (*i)->len = 0;
+    }
+
+    xfree (held);
+}
+
+
+/// Tell the server that we have the base version of the file of @c version, so
+/// that it sends a diff.  This must come after the Directory request for the
+/// file's directory.
+static bool send_entry (cvs_connection_t * s, const version_t * version)
+{
+    delta_base_t * b = delta_base (version);
+    if (b == NULL || b->version == NULL || b->plain || b->sent)
+        return false;
+
+    const char * path = version->file->path;
+    const char * slash = strrchr (path, '/');
+    const char * name = slash ? slash + 1 : path;
+    cvs_printf (s, "Entry /%s/%s//-k%s/\nUnchanged %s\n",
+                name, b->version->version, fetch_keyword_mode, name);
+    b->sent = true;
+    return true;
+}
+
+
+/// Apply the RCS diff @c script to @c base.  Returns a malloc'd text, or NULL
+/// if the diff does not apply.
+static char * apply_diff (const char * base, size_t base_len,
+                          const char * script, size_t script_len,
+                          size_t * len)
+{
+    rcs_line_t * lines_end;
+    rcs_line_t * lines = rcs_split_lines (base, base_len, &lines_end);
+    rcs_line_t * result_end;
+    rcs_line_t * result = rcs_apply_edit (lines, lines_end,
+                                          script, script_len, &result_end);
+    xfree (lines);
+    if (result == NULL)
+        return NULL;
+
+    *len = 0;
+    for (rcs_line_t * i = result; i != result_end; ++i)
+        *len += i->len;
+
+    char * text = xmalloc (*len + 1);
+    char * p = text;
+    for (rcs_line_t * i = result; i != result_end; ++i) {
+        memcpy (p, i->text, i->len);
+        p += i->len;
+    }
+    xfree (result);
+    return text;
+}
+
+
+/// Does [@c text, @c text + @c len) have the MD5 @c checksum, as hex?
+static bool checksum_matches (const char * text, size_t len,
+                              const char * checksum)
+{
+    if (checksum[0] == 0)
+        return true;                    // Nothing to check against.
+
+    unsigned char digest[16];
+    md5 (text, len, digest);
+    char hex[33];
+    for (int i = 0; i != 16; ++i)
+        sprintf (hex + 2 * i, "%02x", digest[i]);
+    return strcasecmp (hex, checksum) == 0;
+}
+
+
+/// With --deltas, read the content of @c version, either whole or as a diff,
+/// and output the blob.  A diff is checked against @c checksum, the MD5 sent
+/// with it, if any.  If a diff fails, then @c version is left unfetched, and
+/// the file is marked for a plain fetch.
+static void read_delta_version (FILE * out, cvs_connection_t * s,
+                                version_t * version, size_t len, bool diff,
+                                const char * checksum)
+{
+    delta_base_t * b = delta_base (version);
+    bool sent = b->sent;
+    b->sent = false;
+
+    char * data;
+    size_t data_len;
+    FILE * f = open_memstream (&data, &data_len);
+    if (f == NULL)
+        fatal ("open_memstream failed: %s\n", strerror (errno));
+    cvs_read_block (s, f, len);
+    if (fclose (f) != 0)
+        fatal ("Reading version failed: %s\n", strerror (errno));
+
+    char * text = data;
+    size_t text_len = data_len;
+    if (!diff)
+        // We got the whole file.  If that was instead of a diff, then the
+        // server's copy of the file is suspect (see the README), so do a
+        // plain fetch next time.
+        b->plain = sent;
+    else {
+        const char * problem = NULL;
+        if (!sent)
+            problem = "unrequested diff";
+        else if ((text = apply_diff (b->text, b->len, data, data_len,
+                                     &text_len)) == NULL)
+            problem = "malformed diff";
+        else if (!checksum_matches (text, text_len, checksum))
+            problem = "checksum mismatch";
+
+        free (data);
+        if (problem) {
+            warning ("cvs checkout %s %s - %s; will fetch whole file\n",
+                     version->file->path, version->version, problem);
+            xfree (text);
+            b->plain = true;
+            b->failed = sent;
+            return;
+        }
+    }
+
+    if (blob_store_dir != NULL)
+        blob_store_put (&blob_store, version->file->rcs_path, version->version,
+                        text, text_len, version->exec);
+    output_fetched_text (out, version, text, text_len);
+    delta_store (version, text, text_len);
+}
+
+
 static void read_version (FILE * out,
                           const database_t * db, cvs_connection_t * s)
 {
+    // A Checksum comes before an Rcs-diff; read them together, so that the
+    // checksum stays with the diff when replies from several connections are
+    // being read in turn.
+    char checksum[33] = "";
+    if (starts_with (s->line, "Checksum ")) {
+        snprintf (checksum, sizeof checksum, "%s", s->line + 9);
+        next_line (s);
+    }
+
     if (starts_with (s->line, "Removed ")) {
         // Removed line; we got the date a bit silly, just ignore it.
         next_line (s);
@@ -119,7 +709,9 @@ static void read_version (FILE * out,
         return;
     }
 
-    if (!starts_with (s->line, "Created ") &&
+    bool diff = starts_with (s->line, "Rcs-diff ");
+    if (!diff &&
+        !starts_with (s->line, "Created ") &&
         !starts_with (s->line, "Update-existing ") &&
         !starts_with (s->line, "Updated "))
         fatal ("Did not get Update line: '%s'\n", s->line);
@@ -171,7 +763,7 @@ static void read_version (FILE * out,
         fatal ("cvs checkout %s %s - got unexpected file mode '%s'\n",
                version->version, version->file->path, s->line);
 
-    version->exec = (strchr (s->line, 'x') != NULL);
+    bool exec = (strchr (s->line, 'x') != NULL);
 
     next_line (s);
     char * tail;
@@ -180,16 +772,23 @@ static void read_version (FILE * out,
         fatal ("cvs checkout %s %s - got unexpected file length '%s'\n",
                version->version, version->file->path, s->line);
 
-    if (version->mark == SIZE_MAX) {
-        version->mark = ++mark_counter;
-        fprintf (out, "blob\nmark :%zu\ndata %lu\n", version->mark, len);
-        cvs_read_block (s, out, len);
-        fprintf (out, "\n");
-    }
-    else {
+    // Once the version is fetched, it belongs to the main thread, so only set
+    // exec before then.
+    if (version->mark == SIZE_MAX)
+        version->exec = exec;
+
+    if (version->mark != SIZE_MAX) {
         warning ("cvs checkout %s %s - version is duplicate\n", path, vers);
         cvs_read_block (s, NULL, len);
+        if (delta_bases)
+            delta_bases[file - delta_files].sent = false;
     }
+    else if (delta_bases)
+        read_delta_version (out, s, version, len, diff, checksum);
+    else if (diff)
+        fatal ("cvs checkout %s %s - got an unexpected diff\n", path, vers);
+    else
+        output_blob (out, s, version, len);
 
     ++s->count_versions;
 
@@ -199,99 +798,261 @@ static void read_version (FILE * out,
 }
 
 
+/// Read the next item of a reply from @c s: a message, or a version.  Returns
+/// true at the "ok" that ends the reply.
+static bool read_reply_item (FILE * out,
+                             const database_t * db, cvs_connection_t * s)
+{
+    next_line (s);
+    if (starts_with (s->line, "M ") || starts_with (s->line, "MT "))
+        return false;
+
+    if (strcmp (s->line, "ok") == 0)
+        return true;
+
+    read_version (out, db, s);
+    return false;
+}
+
+
 static void read_versions (FILE * out,
                            const database_t * db, cvs_connection_t * s)
 {
     ++s->count_transactions;
-    while (1) {
-        next_line (s);
-        if (starts_with (s->line, "M ") || starts_with (s->line, "MT "))
-            continue;
+    while (!read_reply_item (out, db, s));
+}
 
-        if (strcmp (s->line, "ok") == 0)
-            return;
 
-        read_version (out, db, s);
+/// Wait until one of the connections with @c busy set (indexed like
+/// connections) has input, and return it.  The search starts at @c *turn, and
+/// moves it on, so that the connections take turns.
+static cvs_connection_t * next_readable (const bool * busy, size_t * turn)
+{
+    size_t n = connections_end - connections;
+    for (size_t k = 0; k != n; ++k) {
+        size_t c = (*turn + k) % n;
+        if (busy[c] && cvs_input_pending (&connections[c])) {
+            *turn = c + 1;
+            return &connections[c];
+        }
+    }
+
+    struct pollfd fds[n];
+    for (size_t c = 0; c != n; ++c) {
+        fds[c].fd = busy[c] ? connections[c].socket : -1;
+        fds[c].events = POLLIN;
+        fds[c].revents = 0;
+    }
+    while (poll (fds, n, -1) < 0)
+        if (errno != EINTR)
+            fatal ("Waiting for the CVS servers failed: %s\n",
+                   strerror (errno));
+
+    for (size_t k = 0; k != n; ++k) {
+        size_t c = (*turn + k) % n;
+        if (fds[c].revents != 0) {
+            *turn = c + 1;
+            return &connections[c];
+        }
     }
+    fatal ("Waiting for the CVS servers failed: nothing ready\n");
 }
 
 
-static void grab_version (FILE * out, const database_t * db,
-                          cvs_connection_t * s, version_t * version)
+/// For --compress=auto; only call when no replies are outstanding.
+static void adapt_compression (void)
 {
-    if (version == NULL || version->mark != SIZE_MAX)
-        return;
+    for (cvs_connection_t * s = connections; s != connections_end; ++s)
+        cvs_connection_adapt (s);
+}
+
 
+/// Send the request for a single version, without waiting for the reply.
+static void send_version (cvs_connection_t * s, const version_t * version)
+{
     const char * path = version->file->path;
     const char * slash = strrchr (path, '/');
-    // Make sure we have the directory.
-    if (slash != NULL
-        && (version->parent == NULL
-            || version->parent->mark == SIZE_MAX
-            || version->parent->mark <= cached_marks))
-        cvs_printf (s, "Directory %s/%.*s\n" "%s%.*s\n",
-                    s->module, (int) (slash - path), path,
-                    s->prefix, (int) (slash - path), path);
+    const delta_base_t * b = delta_base (version);
+    bool entry = b && b->version && !b->plain && !b->sent;
+    // Make sure the server has the directory.  An Entry needs the directory
+    // sent regardless.
+    if (slash != NULL) {
+        cvs_directory (s, path, slash - path, entry);
+        send_entry (s, version);
+    }
 
     // Go to the main directory.
     cvs_printf (s,
                 "Directory %s\n%.*s\n", s->module,
                 (int) strlen (s->prefix) - 1, s->prefix);
+    if (slash == NULL)
+        send_entry (s, version);
 
     cvs_printff (s,
                  "Argument -k%s\n"
                  "Argument -r%s\n"
                  "Argument --\n"
                  "Argument %s\nupdate\n",
-                 keyword_mode, version->version, version->file->path);
+                 fetch_keyword_mode, version->version, version->file->path);
+}
 
-    read_versions (out, db, s);
 
-    if (version->mark == SIZE_MAX)
-        fatal ("cvs checkout - failed to get %s %s\n",
-               version->file->path, version->version);
+/// Keep at most this much request text unanswered on a connection.
+#define MAX_REQUEST_BYTES (32 << 10)
+
+/// The requests of one connection, in @ref grab_each_version.
+typedef struct fetch_run {
+    size_t next;                        ///< Next to send.
+    size_t answered;                    ///< Next to read the reply for.
+    size_t end;
+    size_t requests;                    ///< Sent and not answered.
+    size_t request_bytes;               ///< Their request text.
+} fetch_run_t;
+
+
+/// Fetch versions one per transaction.  Each file's versions go to one
+/// connection of the pool, with up to @c window in flight on each.  Each
+/// server answers in order, and we read from whichever has a reply ready.
+static void grab_each_version (FILE * out, const database_t * db,
+                               version_t ** fetch, version_t ** fetch_end)
+{
+    adapt_compression();
+
+    // Each file always goes to the same connection, so that each server
+    // process sees consecutive versions of its files.  Sort the requests by
+    // connection, otherwise keeping their order; each connection then has a
+    // run of order, of which [answered, next) have been dealt with.
+    size_t num_connections = connections_end - connections;
+    size_t count = fetch_end - fetch;
+    version_t ** order = ARRAY_ALLOC (version_t *, count);
+    // The request text sent for each, or SIZE_MAX if it was fetched already.
+    size_t * bytes = ARRAY_ALLOC (size_t, count);
+    fetch_run_t * runs = ARRAY_CALLOC (fetch_run_t, num_connections);
+    bool * busy = ARRAY_CALLOC (bool, num_connections);
+
+    for (version_t ** i = fetch; i != fetch_end; ++i)
+        ++runs[((*i)->file - db->files) % num_connections].end;
+    for (size_t c = 0, start = 0; c != num_connections; ++c) {
+        start += runs[c].end;
+        runs[c].next = runs[c].answered = runs[c].end = start - runs[c].end;
+    }
+    for (version_t ** i = fetch; i != fetch_end; ++i)
+        order[runs[((*i)->file - db->files) % num_connections].end++] = *i;
+
+    version_t ** again = NULL;
+    version_t ** again_end = NULL;
+    size_t turn = 0;
+
+    while (true) {
+        // Keep each connection's window full, but with the request text
+        // outstanding well under the pipe buffers.  Otherwise, the server can
+        // block writing a reply while we block writing requests.
+        bool any = false;
+        for (size_t c = 0; c != num_connections; ++c) {
+            fetch_run_t * r = &runs[c];
+            while (r->next != r->end
+                   && (r->requests == 0
+                       || (r->requests < window
+                           && r->request_bytes < MAX_REQUEST_BYTES))) {
+                version_t * v = order[r->next];
+                if (v->mark != SIZE_MAX) {
+                    bytes[r->next++] = SIZE_MAX;
+                    continue;
+                }
+                unsigned long long before = connections[c].sent_bytes;
+                send_version (&connections[c], v);
+                bytes[r->next] = connections[c].sent_bytes - before;
+                r->request_bytes += bytes[r->next++];
+                ++r->requests;
+            }
+            busy[c] = r->requests != 0;
+            any |= busy[c];
+        }
+        if (!any)
+            break;
+
+        // Read a reply from whichever server is ready.
+        cvs_connection_t * s = next_readable (busy, &turn);
+        fetch_run_t * r = &runs[s - connections];
+        while (bytes[r->answered] == SIZE_MAX)
+            ++r->answered;
+        read_versions (out, db, s);
+        delta_trim (db);
+        r->request_bytes -= bytes[r->answered];
+        --r->requests;
+        version_t * v = order[r->answered++];
+        if (v->mark != SIZE_MAX)
+            continue;
+
+        // If a diff failed, try again for the whole file.
+        delta_base_t * b = delta_base (v);
+        if (b == NULL || !b->failed)
+            fatal ("cvs checkout - failed to get %s %s\n",
+                   v->file->path, v->version);
+        b->failed = false;
+        ARRAY_APPEND (again, v);
+    }
+
+    xfree (order);
+    xfree (bytes);
+    xfree (runs);
+    xfree (busy);
+
+    if (again != again_end)
+        grab_each_version (out, db, again, again_end);
+    xfree (again);
 }
 
 
-static void grab_by_option (FILE * out,
-                            const database_t * db,
-                            cvs_connection_t * s,
+static int compare_version_path (const void * AA, const void * BB)
+{
+    const version_t * A = * (version_t * const *) AA;
+    const version_t * B = * (version_t * const *) BB;
+    return strcmp (A->file->path, B->file->path);
+}
+
+
+static void send_by_option (cvs_connection_t * s,
                             const char * r_arg,
                             const char * D_arg,
                             version_t ** fetch, version_t ** fetch_end)
 {
-    // Build an array of the paths that we're getting.  FIXME - if changeset
-    // versions were sorted we wouldn't need this.
-    const char ** paths = NULL;
-    const char ** paths_end = NULL;
+    // Build an array of the versions that we're getting, sorted by path.
+    // FIXME - if changeset versions were sorted we wouldn't need this.
+    version_t ** versions = NULL;
+    version_t ** versions_end = NULL;
 
     for (version_t ** i = fetch; i != fetch_end; ++i) {
         version_t * v = version_live (*i);
         assert (v && v->used && v->mark == SIZE_MAX);
-        ARRAY_APPEND (paths, v->file->path);
+        ARRAY_APPEND (versions, v);
     }
 
-    assert (paths != paths_end);
+    assert (versions != versions_end);
 
-    ARRAY_SORT (paths, (int(*)(const void *, const void *)) strcmp);
+    ARRAY_SORT (versions, compare_version_path);
 
     const char * d = NULL;
     ssize_t d_len = SSIZE_MAX;
+    bool d_sent = false;
 
-    for (const char ** i = paths; i != paths_end; ++i) {
-        const char * slash = strrchr (*i, '/');
+    for (version_t ** i = versions; i != versions_end; ++i) {
+        const char * path = (*i)->file->path;
+        const char * slash = strrchr (path, '/');
         if (slash == NULL)
             continue;
-        if (slash - *i == d_len && memcmp (*i, d, d_len) == 0)
-            continue;
-        // Tell the server about this directory.
-        d = *i;
-        d_len = slash - d;
-        cvs_printf (s,
-                    "Directory %s/%.*s\n"
-                    "%s%.*s\n",
-                    s->module, (int) d_len, d,
-                    s->prefix, (int) d_len, d);
+        const delta_base_t * b = delta_base (*i);
+        bool entry = b && b->version && !b->plain && !b->sent;
+        if (slash - path != d_len || memcmp (path, d, d_len) != 0) {
+            // Tell the server about this directory, if it doesn't know it.
+            // An Entry needs the directory sent regardless.
+            d = path;
+            d_len = slash - d;
+            d_sent = cvs_directory (s, d, d_len, entry);
+        }
+        else if (entry && !d_sent)
+            d_sent = cvs_directory (s, d, d_len, true);
+        send_entry (s, *i);
     }
 
     // Go to the main directory.
@@ -299,6 +1060,10 @@ static void grab_by_option (FILE * out,
                 "Directory %s\n%.*s\n", s->module,
                 (int) (strlen (s->prefix) - 1), s->prefix);
 
+    for (version_t ** i = versions; i != versions_end; ++i)
+        if (strchr ((*i)->file->path, '/') == NULL)
+            send_entry (s, *i);
+
     // Update args:
     if (r_arg)
         cvs_printf (s, "Argument -r%s\n", r_arg);
@@ -306,28 +1071,81 @@ static void grab_by_option (FILE * out,
     if (D_arg)
         cvs_printf (s, "Argument -D%s\n", D_arg);
 
-    cvs_printf (s, "Argument -k%s\n" "Argument --\n", keyword_mode);
+    cvs_printf (s, "Argument -k%s\n" "Argument --\n", fetch_keyword_mode);
 
-    for (const char ** i = paths; i != paths_end; ++i)
-        cvs_printf (s, "Argument %s\n", *i);
+    for (version_t ** i = versions; i != versions_end; ++i)
+        cvs_printf (s, "Argument %s\n", (*i)->file->path);
 
-    xfree (paths);
+    xfree (versions);
 
     cvs_printff (s, "update\n");
+}
+
 
-    read_versions (out, db, s);
+static int compare_version_file (const void * AA, const void * BB)
+{
+    const version_t * A = * (version_t * const *) AA;
+    const version_t * B = * (version_t * const *) BB;
+    return A->file < B->file ? -1 : A->file > B->file;
 }
 
 
-static void grab_versions (FILE * out, const database_t * db,
-                           cvs_connection_t * s,
-                           version_t ** fetch, version_t ** fetch_end)
+static void grab_by_option (FILE * out,
+                            const database_t * db,
+                            const char * r_arg,
+                            const char * D_arg,
+                            version_t ** fetch, version_t ** fetch_end)
 {
+    // Split the fetch into contiguous runs of files, one per connection, so
+    // that each server sees as few directories as possible.
+    size_t count = fetch_end - fetch;
+    size_t slices = connections_end - connections;
+    if (slices > count)
+        slices = count;
+
+    if (slices > 1)
+        qsort (fetch, count, sizeof (version_t *), compare_version_file);
+
+    for (size_t i = 0; i != slices; ++i)
+        send_by_option (connections + i, r_arg, D_arg,
+                        fetch + count * i / slices,
+                        fetch + count * (i + 1) / slices);
+
+    // Read the replies item by item, from whichever server is ready, so that
+    // none of them sits blocked on a full pipe.
+    bool * busy = ARRAY_CALLOC (bool, connections_end - connections);
+    for (size_t i = 0; i != slices; ++i) {
+        busy[i] = true;
+        ++connections[i].count_transactions;
+    }
+    size_t turn = 0;
+    for (size_t left = slices; left != 0; ) {
+        cvs_connection_t * s = next_readable (busy, &turn);
+        if (read_reply_item (out, db, s)) {
+            busy[s - connections] = false;
+            --left;
+        }
+    }
+    xfree (busy);
+}
+
+
+static void grab_cvs_versions (FILE * out, const database_t * db,
+                               version_t ** fetch, version_t ** fetch_end)
+{
+    adapt_compression();
+
     if (fetch_end == fetch)
         return;
 
+    if (connections == connections_end)
+        fatal ("No CVS connection to fetch %s %s\n",
+               fetch[0]->file->path, fetch[0]->version);
+
+    delta_trim (db);
+
     if (fetch_end == fetch + 1) {
-        grab_version (out, db, s, *fetch);
+        grab_each_version (out, db, fetch, fetch_end);
         return;
     }
 
@@ -338,42 +1156,479 @@ static void grab_versions (FILE * out, const database_t * db,
             break;
         }
     if (idver) {
-        grab_by_option (out, db, s,
+        grab_by_option (out, db,
                         fetch[0]->version, NULL,
                         fetch, fetch_end);
         return;
     }
 
-    time_t dmin = fetch[0]->time;
-    time_t dmax = fetch[0]->time;
-    for (version_t ** i = fetch + 1; i != fetch_end; ++i)
-        if ((*i)->time < dmin)
-            dmin = (*i)->time;
-        else if ((*i)->time > dmax)
-            dmax = (*i)->time;
+    time_t dmin = fetch[0]->time;
+    time_t dmax = fetch[0]->time;
+    for (version_t ** i = fetch + 1; i != fetch_end; ++i)
+        if ((*i)->time < dmin)
+            dmin = (*i)->time;
+        else if ((*i)->time > dmax)
+            dmax = (*i)->time;
+
+    if (dmax - dmin < 300 && fetch[0]->branch && !fetch[0]->branch->dummy) {
+        // Format the date.
+        struct tm tm;
+        gmtime_r (&dmax, &tm);
+        char date[64];
+        if (strftime (date, 64, "%d %b %Y %H:%M:%S -0000", &tm) == 0)
+            fatal ("strftime failed\n");
+
+        grab_by_option (out, db,
+                        fetch[0]->branch->tag[0] ? fetch[0]->branch->tag : NULL,
+                        format_date (&dmax, true),
+                        fetch, fetch_end);
+
+        for (version_t ** i = fetch; i != fetch_end; ++i)
+            if ((*i)->mark == SIZE_MAX)
+                fprintf (stderr, "Missed first time round: %s %s\n",
+                         (*i)->file->path, (*i)->version);
+    }
+
+    grab_each_version (out, db, fetch, fetch_end);
+}
+
+
+/// Get the blobs for [@c fetch, @c fetch_end), taking what we can from the blob
+/// store, and fetching the rest from the server.
+static void grab_versions (FILE * out, const database_t * db,
+                           version_t ** fetch, version_t ** fetch_end)
+{
+    if (blob_store_dir == NULL || fetch == fetch_end) {
+        grab_cvs_versions (out, db, fetch, fetch_end);
+        return;
+    }
+
+    version_t ** missed = ARRAY_ALLOC (version_t *, fetch_end - fetch);
+    version_t ** missed_end = missed;
+    for (version_t ** i = fetch; i != fetch_end; ++i) {
+        char * data;
+        size_t len;
+        bool exec;
+        if ((*i)->mark != SIZE_MAX)
+            continue;
+        if (!blob_store_get (&blob_store, (*i)->file->rcs_path,
+                             (*i)->version, &data, &len, &exec)) {
+            *missed_end++ = *i;
+            continue;
+        }
+        (*i)->exec = exec;
+        output_fetched_text (out, *i, data, len);
+        xfree (data);
+    }
+
+    grab_cvs_versions (out, db, missed, missed_end);
+    xfree (missed);
+}
+
+
+/// Order versions for grouping into fetches: by branch, then time, then file.
+static int compare_version_fetch (const void * AA, const void * BB)
+{
+    const version_t * A = * (version_t * const *) AA;
+    const version_t * B = * (version_t * const *) BB;
+    if (A->branch != B->branch)
+        return A->branch < B->branch ? -1 : 1;
+    if (A->time != B->time)
+        return A->time < B->time ? -1 : 1;
+    if (A->file != B->file)
+        return A->file < B->file ? -1 : 1;
+    return A < B ? -1 : A > B;
+}
+
+
+/// Fetch the versions needed by the commits in [@c serial, @c serial_end),
+/// ahead of emitting them.  The versions are grouped by branch and by date, so
+/// that each group can be fetched by a single update request, with one
+/// version of each file per group.  Anything still missing gets fetched by
+/// print_commit as usual.
+static void prefetch_versions (FILE * out, const database_t * db,
+                               changeset_t ** serial, changeset_t ** serial_end)
+{
+    version_t ** fetch = NULL;
+    version_t ** fetch_end = NULL;
+    for (changeset_t ** p = serial; p != serial_end; ++p) {
+        if ((*p)->type != ct_commit)
+            continue;
+        for (version_t ** i = (*p)->versions; i != (*p)->versions_end; ++i) {
+            if (!(*i)->used)
+                continue;
+            version_t * cv = version_live (*i);
+            if (cv != NULL && cv->mark == SIZE_MAX)
+                ARRAY_APPEND (fetch, cv);
+        }
+    }
+
+    ARRAY_SORT (fetch, compare_version_fetch);
+
+    // The group that each file was last added to.
+    size_t * group_of = ARRAY_CALLOC (size_t, db->files_end - db->files);
+    size_t group = 0;
+
+    version_t ** group_start = fetch;
+    version_t ** group_end = fetch;
+    for (version_t ** i = fetch; i != fetch_end; ++i) {
+        if (i != fetch && *i == i[-1])
+            continue;                   // Duplicate.
+
+        size_t * g = &group_of[(*i)->file - db->files];
+        // Keep the date span under that used by grab_versions.
+        if (group_end != group_start
+            && ((*i)->branch != (*group_start)->branch
+                || (*i)->time - (*group_start)->time >= 300
+                || *g == group)) {
+            grab_versions (out, db, group_start, group_end);
+            group_start = group_end;
+        }
+        if (group_end == group_start)
+            ++group;
+
+        *g = group;
+        *group_end++ = *i;
+    }
+    grab_versions (out, db, group_start, group_end);
+
+    xfree (group_of);
+    xfree (fetch);
+}
+
+
+/// Fetch thread: fetch any versions the main thread is waiting for.  Called
+/// with the lock held.
+static void fetch_urgent (void)
+{
+    while (fetcher.urgent != fetcher.urgent_end) {
+        version_t ** fetch = fetcher.urgent;
+        version_t ** fetch_end = fetcher.urgent_end;
+        fetcher.urgent = NULL;
+        fetcher.urgent_end = NULL;
+        pthread_mutex_unlock (&fetcher.lock);
+
+        // Some may have been fetched in the meantime.
+        version_t ** keep = fetch;
+        for (version_t ** i = fetch; i != fetch_end; ++i)
+            if ((*i)->mark == SIZE_MAX)
+                *keep++ = *i;
+        grab_versions (NULL, fetcher.db, fetch, keep);
+        xfree (fetch);
+
+        pthread_mutex_lock (&fetcher.lock);
+    }
+}
+
+
+static void * fetch_thread (void * dummy)
+{
+    (void) dummy;
+    size_t step = lookahead ? lookahead : 1;
+    for (changeset_t ** p = fetcher.serial; p != fetcher.serial_end; ) {
+        pthread_mutex_lock (&fetcher.lock);
+        fetch_urgent();
+        bool quit = fetcher.quit;
+        pthread_mutex_unlock (&fetcher.lock);
+        if (quit)
+            break;
+
+        changeset_t ** next = (size_t) (fetcher.serial_end - p) > step
+            ? p + step : fetcher.serial_end;
+        prefetch_versions (NULL, fetcher.db, p, next);
+        p = next;
+    }
+
+    pthread_mutex_lock (&fetcher.lock);
+    while (true) {
+        fetch_urgent();
+        if (fetcher.quit)
+            break;
+        pthread_cond_wait (&fetcher.fetcher_wake, &fetcher.lock);
+    }
+    fetcher.finished = true;
+    pthread_cond_signal (&fetcher.main_wake);
+    pthread_mutex_unlock (&fetcher.lock);
+    return NULL;
+}
+
+
+/// Main thread: write out whatever the fetch thread has queued.
+static void write_fetched (FILE * out)
+{
+    pthread_mutex_lock (&fetcher.lock);
+    fetched_blob_t * queue = fetcher.queue;
+    fetched_blob_t * queue_end = fetcher.queue_end;
+    fetcher.queue = NULL;
+    fetcher.queue_end = NULL;
+    fetcher.queue_bytes = 0;
+    pthread_cond_signal (&fetcher.fetcher_wake);
+    pthread_mutex_unlock (&fetcher.lock);
+
+    for (fetched_blob_t * i = queue; i != queue_end; ++i) {
+        fprintf (out, "blob\nmark :%zu\ndata %zu\n", i->version->mark, i->len);
+        fwrite (i->data, i->len, 1, out);
+        fprintf (out, "\n");
+        free (i->data);
+    }
+    xfree (queue);
+}
+
+
+/// Get the blobs for [@c fetch, @c fetch_end) output.  With the fetch thread,
+/// wait for it to fetch them, asking for anything it is not already planning
+/// to fetch, and write out everything it has queued; the blob for any version
+/// seen as fetched is then output.
+static void fetch_versions (FILE * out, const database_t * db,
+                            version_t ** fetch, version_t ** fetch_end)
+{
+    if (!fetcher.running) {
+        grab_versions (out, db, fetch, fetch_end);
+        return;
+    }
+
+    bool asked = false;
+    version_t ** i = fetch;
+    while (true) {
+        while (i != fetch_end && version_fetched (*i))
+            ++i;
+        if (i == fetch_end)
+            break;
+
+        pthread_mutex_lock (&fetcher.lock);
+        if (!asked) {
+            // Make sure the fetch thread knows what we need.
+            for (version_t ** j = i; j != fetch_end; ++j)
+                ARRAY_APPEND (fetcher.urgent, *j);
+            pthread_cond_signal (&fetcher.fetcher_wake);
+            asked = true;
+        }
+        // A reused blob marks the version without queueing anything.
+        while (fetcher.queue == fetcher.queue_end && !version_fetched (*i))
+            pthread_cond_wait (&fetcher.main_wake, &fetcher.lock);
+        pthread_mutex_unlock (&fetcher.lock);
+
+        write_fetched (out);
+    }
+
+    write_fetched (out);
+}
+
+
+static void start_fetch_thread (const database_t * db,
+                                changeset_t ** serial, changeset_t ** serial_end)
+{
+    fetcher.db = db;
+    fetcher.serial = serial;
+    fetcher.serial_end = serial_end;
+    int r = pthread_create (&fetcher.thread, NULL, fetch_thread, NULL);
+    if (r != 0)
+        fatal ("pthread_create failed: %s\n", strerror (r));
+    fetcher.running = true;
+}
+
+
+static void stop_fetch_thread (FILE * out)
+{
+    pthread_mutex_lock (&fetcher.lock);
+    fetcher.quit = true;
+    pthread_cond_signal (&fetcher.fetcher_wake);
+    // The fetch thread may be waiting for room in the queue.
+    while (!fetcher.finished) {
+        pthread_mutex_unlock (&fetcher.lock);
+        write_fetched (out);
+        pthread_mutex_lock (&fetcher.lock);
+        if (!fetcher.finished && fetcher.queue == fetcher.queue_end)
+            pthread_cond_wait (&fetcher.main_wake, &fetcher.lock);
+    }
+    pthread_mutex_unlock (&fetcher.lock);
+
+    pthread_join (fetcher.thread, NULL);
+    write_fetched (out);
+    fetcher.running = false;
+    xfree (fetcher.urgent);
+}
+
+
+static int compare_version_time (const void * AA, const void * BB)
+{
+    const version_t * A = * (version_t * const *) AA;
+    const version_t * B = * (version_t * const *) BB;
+    if (A->time != B->time)
+        return A->time < B->time ? -1 : 1;
+    return A < B ? -1 : A > B;
+}
+
+
+/// Fetch every version needed by a commit, file by file, each file's versions
+/// in date order.  The commits then only reference the marks.  The CVS server
+/// still opens the ,v file for each version, but it does so consecutively,
+/// and git-fast-import sees the versions of each file together.
+static void print_blobs (FILE * out, const database_t * db)
+{
+    version_t ** fetch = NULL;
+    version_t ** fetch_end = NULL;
+    for (file_t * f = db->files; f != db->files_end; ++f) {
+        size_t start = fetch_end - fetch;
+        for (version_t * v = f->versions; v != f->versions_end; ++v) {
+            version_t * cv = v->used ? version_live (v) : NULL;
+            if (cv != NULL && cv->mark == SIZE_MAX
+                && (cv == v || !cv->used))
+                // The implicit merge and the vendor version are the same
+                // blob; only take the vendor version once.
+                ARRAY_APPEND (fetch, cv);
+        }
+        qsort (fetch + start, fetch_end - fetch - start,
+               sizeof (version_t *), compare_version_time);
+    }
+
+    fprintf (stderr, "Fetching %zu versions of %zu files.\n",
+             (size_t) (fetch_end - fetch), (size_t) (db->files_end - db->files));
+
+    // Through the blob store, like every other fetch.
+    grab_versions (out, db, fetch, fetch_end);
+
+    xfree (fetch);
+}
+
+
+typedef struct rcs_blobs {
+    FILE * out;
+    file_t * file;
+    const char * cvs_path;              ///< RCS path relative to the root.
+    bool exec;
+    const bool * wanted;                ///< Indexed like file->versions.
+    size_t count;
+} rcs_blobs_t;
+
+
+/// Callback from rcs_walk; output the blob for a revision if we need it.
+static void print_rcs_blob (void * data, const rcs_delta_t * delta,
+                            const rcs_line_t * lines,
+                            const rcs_line_t * lines_end)
+{
+    rcs_blobs_t * b = data;
+
+    char vers[delta->num.len + 1];
+    memcpy (vers, delta->num.data, delta->num.len);
+    vers[delta->num.len] = 0;
+
+    version_t * version = version_live (file_find_version (b->file, vers));
+    if (version == NULL || !b->wanted[version - b->file->versions])
+        return;
+
+    version->exec = b->exec;
+    ++b->count;
+
+    if (!keywords_active (keyword_mode)) {
+        size_t len = 0;
+        for (const rcs_line_t * i = lines; i != lines_end; ++i)
+            len += i->len;
+        sha1_t hash;
+        unsigned char sha[20];
+        sha1_blob_init (&hash, len);
+        for (const rcs_line_t * i = lines; i != lines_end; ++i)
+            sha1_update (&hash, i->text, i->len);
+        sha1_final (&hash, sha);
+        if (reuse_blob (b->out, version, sha))
+            return;
+
+        version->mark = next_mark();
+        fprintf (b->out, "blob\nmark :%zu\ndata %zu\n", version->mark, len);
+        for (const rcs_line_t * i = lines; i != lines_end; ++i)
+            fwrite (i->text, i->len, 1, b->out);
+        fprintf (b->out, "\n");
+        record_blob (version, sha);
+        return;
+    }
+
+    char * log = rcs_text_copy (delta->log, NULL);
+    char * author = rcs_text_copy (delta->author, NULL);
+    char * state = rcs_text_copy (delta->state, NULL);
+    keyword_info_t info = {
+        .rcs_path = b->file->rcs_path,
+        .cvs_path = b->cvs_path,
+        .version = version->version,
+        .author = author,
+        .state = state,
+        .locker = NULL,
+        .log = log,
+        .log_len = strlen (log),
+    };
+    if (!rcs_parse_date (&info.time, delta->date))
+        fatal ("%s: revision %s has bad date\n", b->file->rcs_path, vers);
+
+    char * text = NULL;
+    size_t len = 0;
+    FILE * expanded = open_memstream (&text, &len);
+    if (expanded == NULL)
+        fatal ("open_memstream failed: %s\n", strerror (errno));
+    for (const rcs_line_t * i = lines; i != lines_end; ++i)
+        keywords_expand_line (expanded, keyword_mode, &info, i->text, i->len);
+    if (fclose (expanded) != 0)
+        fatal ("Expanding keywords failed: %s\n", strerror (errno));
+
+    output_blob_text (b->out, version, text, len);
+
+    free (text);
+    xfree (log);
+    xfree (author);
+    xfree (state);
+}
+
 
-    if (dmax - dmin < 300 && fetch[0]->branch && !fetch[0]->branch->dummy) {
-        // Format the date.
-        struct tm tm;
-        gmtime_r (&dmax, &tm);
-        char date[64];
-        if (strftime (date, 64, "%d %b %Y %H:%M:%S -0000", &tm) == 0)
-            fatal ("strftime failed\n");
+/// Output every version that the commits [@c serial, @c serial_end) need
+/// straight from the ,v files, reading each file once.  As with fetching, a
+/// version no commit uses is not output.
+static void print_rcs_blobs (FILE * out, const database_t * db,
+                             changeset_t ** serial, changeset_t ** serial_end)
+{
+    // Where each file's versions start in wanted.
+    size_t * first = ARRAY_ALLOC (size_t, db->files_end - db->files + 1);
+    first[0] = 0;
+    for (file_t * f = db->files; f != db->files_end; ++f)
+        first[f - db->files + 1]
+            = first[f - db->files] + (f->versions_end - f->versions);
+    bool * wanted = ARRAY_CALLOC (bool, first[db->files_end - db->files]);
+    bool * file_wanted = ARRAY_CALLOC (bool, db->files_end - db->files);
 
-        grab_by_option (out, db, s,
-                        fetch[0]->branch->tag[0] ? fetch[0]->branch->tag : NULL,
-                        format_date (&dmax, true),
-                        fetch, fetch_end);
+    for (changeset_t ** p = serial; p != serial_end; ++p) {
+        if ((*p)->type != ct_commit)
+            continue;
+        for (version_t ** i = (*p)->versions; i != (*p)->versions_end; ++i) {
+            if (!(*i)->used)
+                continue;
+            version_t * cv = version_live (*i);
+            if (cv == NULL || cv->mark != SIZE_MAX)
+                continue;
+            size_t f = cv->file - db->files;
+            wanted[first[f] + (cv - cv->file->versions)] = true;
+            file_wanted[f] = true;
+        }
+    }
 
-        for (version_t ** i = fetch; i != fetch_end; ++i)
-            if ((*i)->mark == SIZE_MAX)
-                fprintf (stderr, "Missed first time round: %s %s\n",
-                         (*i)->file->path, (*i)->version);
+    size_t files = 0;
+    rcs_blobs_t b = { .out = out, .count = 0 };
+    for (file_t * f = db->files; f != db->files_end; ++f) {
+        if (!file_wanted[f - db->files])
+            continue;
+
+        rcs_file_t rcs;
+        rcs_open (&rcs, f->rcs_path);
+        b.file = f;
+        b.exec = (rcs.mode & 0111) != 0;
+        b.cvs_path = root_relative (rcs_root, f->rcs_path);
+        b.wanted = wanted + first[f - db->files];
+        rcs_walk (&rcs, print_rcs_blob, &b);
+        rcs_close (&rcs);
+        ++files;
     }
 
-    for (version_t ** i = fetch; i != fetch_end; ++i)
-        if ((*i)->mark == SIZE_MAX)
-            grab_version (out, db, s, *i);
+    fprintf (stderr, "Read %zu versions from %zu RCS files.\n", b.count, files);
+
+    xfree (file_wanted);
+    xfree (wanted);
+    xfree (first);
 }
 
 
@@ -452,8 +1707,147 @@ static const char * output_entries_list (FILE * out,
 }
 
 
-static void print_commit (FILE * out, const database_t * db, changeset_t * cs,
-                          cvs_connection_t * s)
+/// The identity of a commit, being built up.  This is a digest of everything
+/// that goes into the git commit, except that parents are given by their
+/// identities, and file contents by CVS version.  So a commit has the same
+/// identity on the next run if and only if it would come out the same.
+typedef struct commit_id {
+    FILE * f;
+    char * text;
+    size_t len;
+    bool ok;                            ///< False if the identity is unknown.
+} commit_id_t;
+
+
+/// Add the commit with @c mark as a parent.
+static void commit_id_parent (commit_id_t * id, size_t mark)
+{
+    if (mark < commit_keys_size && commit_keys[mark] != NULL)
+        fprintf (id->f, "parent %s\n", commit_keys[mark]);
+    else
+        id->ok = false;
+}
+
+
+/// Start the identity of a commit on top of the commit with @c mark (zero for
+/// none).
+static void commit_id_start (commit_id_t * id, size_t mark)
+{
+    id->text = NULL;
+    id->len = 0;
+    id->ok = true;
+    id->f = open_memstream (&id->text, &id->len);
+    if (id->f == NULL)
+        fatal ("open_memstream failed: %s\n", strerror (errno));
+
+    // Anything that changes the content of every commit.
+    fprintf (id->f, "keywords %s%s\nentries %s\n",
+             keyword_mode, local_keywords ? " local" : "",
+             entries_name ? entries_name : "");
+    if (mark != 0)
+        commit_id_parent (id, mark);
+}
+
+
+/// Add a file modification to the identity; a NULL @c version is a delete.
+static void commit_id_file (commit_id_t * id, const file_t * file,
+                            const version_t * version)
+{
+    if (version == NULL || version->dead)
+        fprintf (id->f, "D %s\n", file->path);
+    else if (!version_fetched (version))
+        id->ok = false;                 // Don't know the mode yet.
+    else
+        fprintf (id->f, "M %c %s %s\n",
+                 version->exec ? 'x' : '-', version->version, file->path);
+}
+
+
+/// Return the identity as a cached hex string, or NULL if it is not known.
+static const char * commit_id_finish (commit_id_t * id)
+{
+    fclose (id->f);
+    const char * key = NULL;
+    if (id->ok) {
+        unsigned char digest[16];
+        md5 (id->text, id->len, digest);
+        char hex[33];
+        for (int i = 0; i != 16; ++i)
+            sprintf (hex + 2 * i, "%02x", digest[i]);
+        key = cache_string (hex);
+    }
+    free (id->text);
+    return key;
+}
+
+
+/// Record @c key as the identity of the commit with @c mark.
+static void set_commit_key (size_t mark, const char * key)
+{
+    if (mark >= commit_keys_size) {
+        size_t size = commit_keys_size ? commit_keys_size : 1024;
+        while (size <= mark)
+            size *= 2;
+        commit_keys = ARRAY_REALLOC (commit_keys, size);
+        memset (commit_keys + commit_keys_size, 0,
+                (size - commit_keys_size) * sizeof commit_keys[0]);
+        commit_keys_size = size;
+    }
+    commit_keys[mark] = key;
+}
+
+
+/// The identity of the commit for @c cs, on top of the commit with @c parent.
+static const char * changeset_key (changeset_t * cs, size_t parent)
+{
+    commit_id_t id;
+    commit_id_start (&id, parent);
+
+    for (changeset_t ** i = cs->merge; i != cs->merge_end; ++i)
+        if ((*i)->mark != 0)
+            commit_id_parent (&id, (*i)->mark);
+
+    version_t * v = cs->versions[0];
+    fprintf (id.f, "committer %s %ld\n%s\n", v->author, cs->time, v->log);
+
+    for (version_t ** i = cs->versions; i != cs->versions_end; ++i)
+        if ((*i)->used) {
+            version_t * vv = version_normalise (*i);
+            commit_id_file (&id, vv->file, vv);
+        }
+
+    return commit_id_finish (&id);
+}
+
+
+/// If the commit cache has a commit with identity @c key, point @c branch at
+/// it, and return its mark.  Else return zero.
+static size_t reuse_commit (const database_t * db, tag_t * branch,
+                            const char * key)
+{
+    commit_cache_item_t * item = string_hash_find (&commit_cache, key);
+    if (item == NULL)
+        return 0;
+
+    set_commit_key (item->mark, key);
+    stale_refs[branch - db->tags] = true;
+    ++reused_commits;
+    return item->mark;
+}
+
+
+/// If the ref for @c tag is stale, give @c from as the commit parent.
+static void print_stale_from (FILE * out, const database_t * db,
+                              const tag_t * tag, size_t from)
+{
+    if (stale_refs != NULL && stale_refs[tag - db->tags]) {
+        fprintf (out, "from :%zu\n", from);
+        stale_refs[tag - db->tags] = false;
+    }
+}
+
+
+static void print_commit (FILE * out, const database_t * db, changeset_t * cs)
 {
     version_t * v = cs->versions[0];
 
@@ -466,19 +1860,39 @@ static void print_commit (FILE * out, const database_t * db, changeset_t * cs,
             continue;
 
         version_t * cv = version_live (*i);
-        if (cv != NULL && cv->mark == SIZE_MAX)
+        if (cv != NULL && !version_fetched (cv))
             ARRAY_APPEND (fetch, cv);
     }
 
     fprintf (stderr, "%s COMMIT", format_date (&cs->time, false));
 
+    size_t parent = v->branch->changeset.mark;
+    const char * key = NULL;
+    if (use_commit_cache && fetch == fetch_end)
+        key = changeset_key (cs, parent);
+
+    size_t reused = key ? reuse_commit (db, v->branch, key) : 0;
+    if (reused != 0) {
+        xfree (fetch);
+        v->branch->last = cs;
+        cs->mark = reused;
+        v->branch->changeset.mark = cs->mark;
+        fprintf (stderr, " (cached)\n");
+        return;
+    }
+
     // Get the versions.
-    grab_versions (out, db, s, fetch, fetch_end);
+    fetch_versions (out, db, fetch, fetch_end);
     xfree (fetch);
 
+    if (use_commit_cache && key == NULL)
+        key = changeset_key (cs, parent);
+
     v->branch->last = cs;
-    cs->mark = ++mark_counter;
+    cs->mark = next_mark();
     v->branch->changeset.mark = cs->mark;
+    if (key != NULL)
+        set_commit_key (cs->mark, key);
 
     fprintf (out, "commit %s/%s\n",
              branch_prefix, *v->branch->tag ? v->branch->tag : master);
@@ -486,10 +1900,11 @@ static void print_commit (FILE * out, const database_t * db, changeset_t * cs,
     fprintf (out, "committer %s <%s> %ld +0000\n",
              v->author, v->author, cs->time);
     fprintf (out, "data %zu\n%s\n", strlen (v->log), v->log);
+    print_stale_from (out, db, v->branch, parent);
     for (changeset_t ** i = cs->merge; i != cs->merge_end; ++i)
         if ((*i)->mark == 0)
             fprintf (stderr, "Whoops, out of order!\n");
-        else if ((*i)->mark == mark_counter)
+        else if ((*i)->mark == cs->mark)
             fprintf (stderr, "Whoops, self-ref\n");
         else
             fprintf (out, "merge :%zu\n", (*i)->mark);
@@ -511,8 +1926,7 @@ static void print_commit (FILE * out, const database_t * db, changeset_t * cs,
 }
 
 
-static void print_tag (FILE * out, const database_t * db, tag_t * tag,
-                       cvs_connection_t * s)
+static void print_tag (FILE * out, const database_t * db, tag_t * tag)
 {
     fprintf (stderr, "%s %s %s\n",
              format_date (&tag->changeset.time, false),
@@ -562,12 +1976,14 @@ static void print_tag (FILE * out, const database_t * db, tag_t * tag,
                  *tag->tag ? tag->tag : master);
         if (tag->changeset.mark != 0)
             fprintf (out, "from :%zu\n", tag->changeset.mark);
+        if (stale_refs != NULL)
+            stale_refs[tag - db->tags] = false;
     }
 
     if (tag->branch_versions == NULL)
         // For a tag, just force out all the fixups immediately.
         print_fixups (out, db, branch ? branch->branch_versions : NULL,
-                      tag, NULL, s);
+                      tag, NULL);
 }
 
 
@@ -575,8 +1991,7 @@ static void print_tag (FILE * out, const database_t * db, tag_t * tag,
 /// commit is created.
 void print_fixups (FILE * out, const database_t * db,
                    version_t ** base_versions,
-                   tag_t * tag, const changeset_t * cs,
-                   cvs_connection_t * s)
+                   tag_t * tag, const changeset_t * cs)
 {
     fixup_ver_t * fixups;
     fixup_ver_t * fixups_end;
@@ -599,17 +2014,17 @@ void print_fixups (FILE * out, const database_t * db,
     version_t ** fetch_end = NULL;
     for (fixup_ver_t * ffv = fixups; ffv != fixups_end; ++ffv)
         if (ffv->version != NULL && !ffv->version->dead
-            && ffv->version->mark == SIZE_MAX)
+            && !version_fetched (ffv->version))
             ARRAY_APPEND (fetch, ffv->version);
 
     // FIXME - grab_versions assumes that all versions are on the same branch!
     // We should pass in the tag rather than guessing it!
-    grab_versions (out, db, s, fetch, fetch_end);
+    fetch_versions (out, db, fetch, fetch_end);
     xfree (fetch);
 
     tag->fixup = true;
     size_t from = tag->changeset.mark;
-    tag->changeset.mark = ++mark_counter;
+    tag->changeset.mark = next_mark();
 
     if (tag->deleted)
         fprintf (out, "commit _crap_zombie\n");
@@ -626,9 +2041,27 @@ void print_fixups (FILE * out, const database_t * db,
     const char * comment = fixup_commit_comment (
         db, base_versions, fixups, fixups_end);
     fprintf (out, "data %zu\n%s", strlen (comment), comment);
+
+    // Fix-up commits are always written, but need an identity for their
+    // children to be reused.
+    if (use_commit_cache) {
+        commit_id_t id;
+        commit_id_start (&id, from);
+        fprintf (id.f, "fixup %ld\n%s",
+                 tag->branch_versions && tag->last
+                 ? tag->last->time : tag->changeset.time, comment);
+        for (fixup_ver_t * ffv = fixups; ffv != fixups_end; ++ffv)
+            commit_id_file (&id, ffv->file, ffv->version);
+        const char * key = commit_id_finish (&id);
+        if (key != NULL)
+            set_commit_key (tag->changeset.mark, key);
+    }
+
     xfree (comment);
     if (tag->deleted)
         fprintf (out, "from :%zu\n", from);
+    else
+        print_stale_from (out, db, tag, from);
 
     // We need a list of versions for updating the entries files.  If we are
     // working on a branch, then we need to update that anyway.  Else take a
@@ -668,7 +2101,137 @@ void print_fixups (FILE * out, const database_t * db,
 }
 
 
-/// Read in our version-sha file and generate marks.
+/// Read in the commit cache, giving each commit a mark in @c output_marks.
+static void load_commit_cache (FILE * output_marks)
+{
+    string_hash_init (&commit_cache);
+
+    FILE * cache = fopen (commit_cache_path, "r");
+    if (cache == NULL) {
+        if (errno != ENOENT)
+            warning ("opening %s failed: %s\n", commit_cache_path,
+                     strerror (errno));
+        return;
+    }
+
+    char key[33];
+    char sha[41];
+    while (fscanf (cache, "%32[0-9a-f] %40[0-9a-f]\n", key, sha) == 2) {
+        bool n;
+        commit_cache_item_t * item = string_hash_insert (
+            &commit_cache, cache_string (key), sizeof (commit_cache_item_t),
+            &n);
+        if (!n)
+            continue;
+        item->mark = ++mark_counter;
+        fprintf (output_marks, ":%zu %s\n", item->mark, sha);
+    }
+
+    fclose (cache);
+}
+
+
+/// Is @c mark a commit in the checkpoint log being resumed?
+static bool checkpoint_mark_wanted (size_t mark)
+{
+    return mark < commit_keys_size && commit_keys[mark] != NULL;
+}
+
+
+/// With --resume, add the commits that git has from the run that left the
+/// checkpoint log to the commit cache, so that they are reused.  The log is
+/// only good with the marks file of that run, so it is removed either way.
+static void resume_checkpoint (const char * marks_path)
+{
+    FILE * log = resume && use_commit_cache
+        ? fopen (checkpoint_path, "r") : NULL;
+    if (log == NULL) {
+        if (resume && use_commit_cache && errno != ENOENT)
+            warning ("opening %s failed: %s\n", checkpoint_path,
+                     strerror (errno));
+        unlink (checkpoint_path);
+        return;
+    }
+
+    size_t serial = 0;
+    char * line = NULL;
+    size_t line_size = 0;
+    while (getline (&line, &line_size, log) > 0) {
+        size_t mark;
+        char key[33];
+        if (sscanf (line, ":%zu %32[0-9a-f]", &mark, key) == 2)
+            set_commit_key (mark, cache_string (key));
+        else if (sscanf (line, "serial %zu", &serial) != 1)
+            break;
+    }
+    free (line);
+    fclose (log);
+    unlink (checkpoint_path);
+
+    size_t count = 0;
+    sha_table_t shas;
+    sha_table_init (&shas);
+    FILE * cache = NULL;
+    if (sha_table_read_marks (&shas, marks_path, checkpoint_mark_wanted)) {
+        cache = fopen (commit_cache_path, "a");
+        if (cache == NULL)
+            warning ("opening %s failed: %s\n",
+                     commit_cache_path, strerror (errno));
+    }
+    for (size_t i = 0; cache && i != commit_keys_size; ++i) {
+        const unsigned char * sha = sha_table_get (&shas, i);
+        if (commit_keys[i] == NULL || sha == NULL)
+            continue;
+        char hex[41];
+        sha_to_hex (hex, sha);
+        fprintf (cache, "%s %s\n", commit_keys[i], hex);
+        ++count;
+    }
+    if (cache)
+        fclose (cache);
+    sha_table_destroy (&shas);
+
+    // The marks are renumbered from here on.
+    xfree (commit_keys);
+    commit_keys = NULL;
+    commit_keys_size = 0;
+
+    fprintf (stderr, "Resuming with %zu commits from a checkpoint after %zu "
+             "changesets.\n", count, serial);
+}
+
+
+/// For --checkpoint: log the commits sent so far, and the number @c serial of
+/// changesets done, then have git fast-import write out what it has.
+static void checkpoint (FILE * out, size_t serial)
+{
+    if (checkpoint_log == NULL) {
+        checkpoint_log = fopen (checkpoint_path, "w");
+        if (checkpoint_log == NULL)
+            fatal ("opening %s failed: %s\n",
+                   checkpoint_path, strerror (errno));
+    }
+
+    for (size_t i = checkpoint_logged; i < commit_keys_size; ++i)
+        if (commit_keys[i] != NULL) {
+            fprintf (checkpoint_log, ":%zu %s\n", i, commit_keys[i]);
+            checkpoint_logged = i + 1;
+        }
+    fprintf (checkpoint_log, "serial %zu\n", serial);
+    if (fflush (checkpoint_log) != 0)
+        warning ("writing %s failed: %s\n",
+                 checkpoint_path, strerror (errno));
+
+    pthread_mutex_lock (&blob_lock);
+    version_cache_flush (&version_cache);
+    pthread_mutex_unlock (&blob_lock);
+
+    fprintf (out, "checkpoint\n");
+    fflush (out);
+}
+
+
+/// Read in our version cache and generate marks.
 static void initial_process_marks (const database_t * db)
 {
     const char * crap_dir = xasprintf ("%s/crap", git_dir);
@@ -678,126 +2241,198 @@ static void initial_process_marks (const database_t * db)
 
     const char * marks_path = xasprintf (
         "%s/crap/marks%s%s.txt", git_dir, *remote ? "." : "", remote);
+    // Before the marks of the run being resumed are overwritten.
+    if (checkpoint_path != NULL)
+        resume_checkpoint (marks_path);
+
     FILE * output_marks = fopen (marks_path, "w");
     xfree (marks_path);
     if (output_marks == NULL)
         fatal ("opening marks file failed: %s\n", strerror (errno));
 
-    FILE * cache = fopen (version_cache_path, "r");
-    if (cache == NULL) {
-        warning ("opening %s failed: %s\n", version_cache_path,
-                 strerror (errno));
-        fclose (output_marks);
-        return;
-    }
+    if (use_commit_cache)
+        load_commit_cache (output_marks);
 
-    // FIXME - error handling.
-    char * line = NULL;
-    size_t line_max = 0;
+    // Blobs are only recorded as they go into git.
+    version_cache_load (&version_cache, version_cache_path,
+                        legacy_version_cache_path, output_path == NULL, db,
+                        output_marks, &mark_counter);
 
-    while (true) {
-        uint32_t sha[5];
-        char mode;
-        if (fscanf (cache, "%8x%8x%8x%8x%8x %c",
-                    &sha[0], &sha[1], &sha[2], &sha[3], &sha[4], &mode) < 6)
-            break;
+    fclose (output_marks);
+}
 
-        if (mode != '-' && mode != 'x')
-            break;
 
-        ssize_t ll = getline (&line, &line_max, cache);
-        if (ll <= 0)
-            break;
+/// Is the SHA-1 of @c mark needed after the import?  We know those of the
+/// blobs already, so only commits.
+static bool mark_wanted (size_t mark)
+{
+    return mark <= mark_counter
+        && mark < commit_keys_size && commit_keys[mark] != NULL;
+}
 
-        if (line[ll - 1] == '\n')
-            line[ll - 1] = 0;
 
-        char * ver = line;
-        if (*ver == ' ')
-            ++ver;
+/// Read in the marks file written by git-fast-import, and write out the commit
+/// cache.
+static void final_process_marks (void)
+{
+    if (!use_commit_cache)
+        return;
+
+    const char * marks_path = xasprintf ("%s/crap/marks%s%s.txt", git_dir,
+                                         *remote ? "." : "", remote);
+    sha_table_t shas;
+    sha_table_init (&shas);
+    bool ok = sha_table_read_marks (&shas, marks_path, mark_wanted);
+    xfree (marks_path);
+    if (!ok)
+        return;
 
-        char * path = strchr (ver, ' ');
-        if (path == NULL)
+    FILE * out = fopen (commit_cache_path, "w");
+    if (out == NULL)
+        warning ("opening %s failed: %s\n",
+                 commit_cache_path, strerror (errno));
+    for (size_t i = 0; out && i != commit_keys_size; ++i) {
+        const unsigned char * sha = sha_table_get (&shas, i);
+        if (commit_keys[i] == NULL || sha == NULL)
             continue;
+        char hex[41];
+        sha_to_hex (hex, sha);
+        fprintf (out, "%s %s\n", commit_keys[i], hex);
+    }
+    if (out)
+        fclose (out);
 
-        *path++ = 0;
+    sha_table_destroy (&shas);
+}
 
-        // Attempt to find the path and version.
-        const file_t * f = database_find_file (db, path);
-        if (!f)
-            continue;
 
-        version_t * v = file_find_version (f, ver);
-        if (v) {
-            v->mark = ++mark_counter;
-            v->exec = mode == 'x';
-            fprintf (output_marks, ":%zu %08x%08x%08x%08x%08x\n",
-                     mark_counter, sha[0], sha[1], sha[2], sha[3], sha[4]);
-        }
-    }
+/// The path of @c module in the repository at @c root, with a trailing '/'.
+static const char * module_prefix (const char * root, const char * module)
+{
+    int root_len = strlen (root);
+    while (root_len > 0 && root[root_len - 1] == '/')
+        --root_len;
+    return xasprintf ("%.*s/%s/", root_len, root, module);
+}
 
-    cached_marks = mark_counter;
 
-    xfree (line);
+/// Connect to the CVS server and set up for accessing @c module.
+static void open_connection (cvs_connection_t * s,
+                             const char * root, const char * module)
+{
+    connect_to_cvs (s, root);
 
-    fclose (cache);
-    fclose (output_marks);
+    if (zauto)
+        cvs_connection_compress_auto (s);
+    else if (zlevel != 0)
+        cvs_connection_compress (s, zlevel);
+
+    s->module = xstrdup (module);
+    s->prefix = module_prefix (s->remote_root, s->module);
+
+    cvs_printf (s, "Global_option -q\n");
 }
 
 
-/// Read in the marks file written by git-fast-import, and write out a file
-/// containing the id's in a form that is useful for us to re-read.
-static void final_process_marks (const database_t * db)
+/// For --watch: add watches on @c dir and every directory below it.
+static void watch_tree (const char * dir)
 {
-    const char * marks_path = xasprintf ("%s/crap/marks%s%s.txt", git_dir,
-                                         *remote ? "." : "", remote);
-    FILE * marks = fopen (marks_path, "r");
-    xfree (marks_path);
-    if (marks == NULL) {
-        warning ("open crap/marks.txt failed: %s\n", strerror (errno));
+    if (inotify_add_watch (watch_fd, dir,
+                           IN_CLOSE_WRITE | IN_MOVED_TO | IN_MOVED_FROM
+                           | IN_CREATE | IN_DELETE | IN_ONLYDIR) < 0) {
+        warning ("watching %s failed: %s\n", dir, strerror (errno));
+        return;
+    }
+
+    DIR * d = opendir (dir);
+    if (d == NULL)
         return;
+    struct dirent * e;
+    while ((e = readdir (d)) != NULL) {
+        // Skip ., .. and the CVS lock directories.
+        if (e->d_name[0] == '.' || e->d_name[0] == '#')
+            continue;
+        char * sub = xasprintf ("%s/%s", dir, e->d_name);
+        struct stat st;
+        if (e->d_type == DT_DIR
+            || (e->d_type == DT_UNKNOWN && stat (sub, &st) == 0
+                && S_ISDIR (st.st_mode)))
+            watch_tree (sub);
+        xfree (sub);
     }
-    assert (sizeof (uint32_t) == 4);
-    assert (mark_counter < LONG_MAX / 20);
-    uint32_t * shas = xcalloc (mark_counter * 20 + 20);
+    closedir (d);
+}
+
+
+/// Does @c ev change the history?  CVS and rsync write under a temporary name
+/// and rename, and CVS locks with '#' names, so only ,v files and directories
+/// count.
+static bool watch_event_matters (const struct inotify_event * ev)
+{
+    if (ev->mask & IN_Q_OVERFLOW)
+        return true;
+    if (ev->len == 0 || ev->name[0] == '#')
+        return false;
+    if (ev->mask & IN_ISDIR)
+        return true;
+    size_t len = strlen (ev->name);
+    return len > 2 && strcmp (ev->name + len - 2, ",v") == 0;
+}
 
+
+/// For --watch: wait for a change to the ,v files, and then for the repository
+/// to be quiet for @c watch_quiet seconds.  Any activity, even locking,
+/// restarts the quiet period.
+static void wait_for_changes (void)
+{
+    bool changed = false;
+    char buf[65536]
+        __attribute__ ((aligned (__alignof__ (struct inotify_event))));
     while (true) {
-        size_t mark;
-        uint32_t sha[5];
-        if (fscanf (marks, ":%zu %8x%8x%8x%8x%8x\n",
-                    &mark, &sha[0], &sha[1], &sha[2], &sha[3], &sha[4]) < 6)
+        struct pollfd p = { .fd = watch_fd, .events = POLLIN };
+        int ready = poll (&p, 1, changed ? (int) watch_quiet * 1000 : -1);
+        if (ready == 0)
             break;
-
-        if (mark <= mark_counter)
-            memcpy (shas + mark * 5, sha, 20);
+        ssize_t len = ready < 0 ? -1 : read (watch_fd, buf, sizeof buf);
+        if (len < 0 && errno == EINTR)
+            continue;
+        if (len < 0)
+            fatal ("watching for changes failed: %s\n", strerror (errno));
+
+        for (char * i = buf; i < buf + len; ) {
+            const struct inotify_event * ev = (const void *) i;
+            if (watch_event_matters (ev))
+                changed = true;
+            i += sizeof *ev + ev->len;
+        }
     }
 
-    fclose (marks);
+    close (watch_fd);
+    watch_fd = -1;
+}
 
-    // FIXME - bounce via temporary.
-    marks = fopen (version_cache_path, "w");
-    if (marks == NULL) {
-        free (shas);
-        warning ("opening %s failed: %s\n",
-                 version_cache_path, strerror (errno));
-        return;
-    }
 
-    for (const file_t * f = db->files; f != db->files_end; ++f)
-        for (const version_t * v = f->versions; v != f->versions_end; ++v) {
-            if (v->mark > mark_counter)
-                continue;
-            const uint32_t * p = shas + 5 * v->mark;
-            if (p[0] | p[1] | p[2] | p[3] | p[4])
-                fprintf (marks, "%08x%08x%08x%08x%08x %c %s %s\n",
-                         p[0], p[1], p[2], p[3], p[4],
-                         v->exec ? 'x' : '-', v->version, f->path);
-        }
+/// Find libcrap-buffer.so alongside our executable, to preload into local cvs
+/// server processes.  Returns NULL if there is none.
+static const char * find_preload (void)
+{
+    char exe[PATH_MAX];
+    ssize_t len = readlink ("/proc/self/exe", exe, sizeof exe - 1);
+    if (len <= 0)
+        return NULL;
+    exe[len] = 0;
+
+    const char * slash = strrchr (exe, '/');
+    if (slash == NULL)
+        return NULL;
 
-    // FIXME - check errors on write...
-    fclose (marks);
+    const char * path = xasprintf ("%.*s/libcrap-buffer.so",
+                                   (int) (slash - exe), exe);
+    if (access (path, R_OK) == 0)
+        return path;
 
-    free (shas);
+    xfree (path);
+    return NULL;
 }
 
 
@@ -806,8 +2441,11 @@ static void usage (const char * prog, FILE * stream, int code)
 static void usage (const char * prog, FILE * stream, int code)
 {
     fprintf (stream, "Usage: %s [options] <ROOT> <MODULE>\n\
-  -z, --compress=[0-9]   Compress the CVS network traffic.\n\
+  -z, --compress=[0-9]   Compress the CVS network traffic.  With 'auto',\n\
+                         choose the level from the measured link speed.\n\
   -h, --help             This message.\n\
+  -j, --jobs=N           Fetch file versions over N parallel connections to\n\
+                         the CVS server.\n\
   -o, --output=FILE      Send output to a file instead of git-fast-import.\n\
                          If FILE starts with '|' then pipe to a command.\n\
   -F, --filter=COMMAND   Use COMMAND as a filter on the version/branch/tag\n\
@@ -829,6 +2467,41 @@ static void usage (const char * prog, FILE * stream, int code)
       --fuzz-gap=SECONDS The maximum time between two consecutive commits of a\n\
                          changeset (default 300 seconds).\n\
       --keywords=MODE    The CVS substitution mode to use (default: 'kk')\n\
+      --rcs              Read file versions directly from the ,v files instead\n\
+                         of via the CVS server.  Local repositories only.\n\
+      --window=N         Keep up to N update requests in flight on each\n\
+                         connection (default 1).\n\
+      --buffer-size=KIB  The size of the buffers for each CVS connection\n\
+                         (default 256).\n\
+      --deltas[=MIB]     Fetch file versions as diffs against the previous\n\
+                         version, keeping up to MIB of file content in memory\n\
+                         (default 256).\n\
+      --lookahead=N      Fetch the file versions for the next N changesets\n\
+                         together (default 0, fetch for each commit).\n\
+      --blobs-first      Fetch all the file versions, file by file, before\n\
+                         emitting any commits.\n\
+      --fetch-thread[=MIB]  Fetch file versions in a separate thread, queueing\n\
+                         up to MIB of them (default 64).\n\
+      --no-preload       Do not load libcrap-buffer.so into local cvs server\n\
+                         processes.\n\
+      --no-snapshot      Re-read the history of every file, instead of only\n\
+                         those changed since the last run.\n\
+      --no-commit-cache  Write every commit again, instead of reusing those\n\
+                         unchanged since the last run.\n\
+      --blob-store=DIR   Keep the file versions fetched from the server in\n\
+                         DIR, and take them from there instead of fetching\n\
+                         them again.\n\
+      --blob-store-limit=MIB  Evict the least recently used versions from the\n\
+                         blob store to keep it under MIB (default no limit).\n\
+      --local-keywords   Fetch file versions with -ko and expand the keywords\n\
+                         here, instead of on the server.\n\
+      --checkpoint[=SECONDS]  Have git-fast-import checkpoint every SECONDS\n\
+                         (default 300), logging what it has, for --resume.\n\
+      --resume           Reuse the commits from the last checkpoint of an\n\
+                         import that failed.\n\
+      --watch[=SECONDS]  After the import, watch a local repository, and\n\
+                         import again once changes have been quiet for\n\
+                         SECONDS (default 5).\n\
   <ROOT>                 The CVS repository to access.\n\
   <MODULE>               The relative path within the CVS repository.\n",
              prog);
@@ -841,7 +2514,7 @@ static void process_opts (int argc, char * const argv[])
 {
     while (1)
         switch (getopt_long (argc, argv,
-                             "b:c:d:e:F:fhz:m:o:r:t:k:", opts, NULL)) {
+                             "b:c:d:e:F:fhj:z:m:o:r:t:k:", opts, NULL)) {
         case 'b':
             branch_prefix = optarg;
             break;
@@ -860,6 +2533,11 @@ static void process_opts (int argc, char * const argv[])
         case 'f':
             force = true;
             break;
+        case 'j':
+            jobs = strtoul (optarg, NULL, 10);
+            if (jobs == 0)
+                usage (argv[0], stderr, EXIT_FAILURE);
+            break;
         case 'o':
             output_path = optarg;
             break;
@@ -873,7 +2551,8 @@ static void process_opts (int argc, char * const argv[])
             tag_prefix = optarg;
             break;
         case 'z':
-            zlevel = strtoul (optarg, NULL, 10);
+            zauto = strcmp (optarg, "auto") == 0;
+            zlevel = zauto ? 0 : strtoul (optarg, NULL, 10);
             if (zlevel > 9)
                 usage (argv[0], stderr, EXIT_FAILURE);
             break;
@@ -887,6 +2566,67 @@ static void process_opts (int argc, char * const argv[])
         case opt_fuzz_gap:
             fuzz_gap = strtoul (optarg, NULL, 10);
             break;
+        case opt_rcs:
+            read_rcs = true;
+            break;
+        case opt_window:
+            window = strtoul (optarg, NULL, 10);
+            if (window == 0)
+                usage (argv[0], stderr, EXIT_FAILURE);
+            break;
+        case opt_deltas:
+            delta_budget = (optarg ? strtoul (optarg, NULL, 10) : 256) << 20;
+            if (delta_budget == 0)
+                usage (argv[0], stderr, EXIT_FAILURE);
+            break;
+        case opt_fetch_thread:
+            fetcher.queue_limit
+                = (optarg ? strtoul (optarg, NULL, 10) : 64) << 20;
+            if (fetcher.queue_limit == 0)
+                usage (argv[0], stderr, EXIT_FAILURE);
+            break;
+        case opt_no_preload:
+            no_preload = true;
+            break;
+        case opt_no_snapshot:
+            no_snapshot = true;
+            break;
+        case opt_no_commit_cache:
+            no_commit_cache = true;
+            break;
+        case opt_blob_store:
+            blob_store_dir = optarg;
+            break;
+        case opt_blob_store_limit:
+            blob_store_limit = strtoul (optarg, NULL, 10);
+            break;
+        case opt_local_keywords:
+            local_keywords = true;
+            break;
+        case opt_checkpoint:
+            checkpoint_interval = optarg ? strtoul (optarg, NULL, 10) : 300;
+            if (checkpoint_interval == 0)
+                usage (argv[0], stderr, EXIT_FAILURE);
+            break;
+        case opt_resume:
+            resume = true;
+            break;
+        case opt_watch:
+            watch_quiet = optarg ? strtoul (optarg, NULL, 10) : 5;
+            if (watch_quiet == 0)
+                usage (argv[0], stderr, EXIT_FAILURE);
+            break;
+        case opt_blobs_first:
+            blobs_first = true;
+            break;
+        case opt_lookahead:
+            lookahead = strtoul (optarg, NULL, 10);
+            break;
+        case opt_buffer_size:
+            cvs_buffer_size = strtoul (optarg, NULL, 10) << 10;
+            if (cvs_buffer_size == 0)
+                usage (argv[0], stderr, EXIT_FAILURE);
+            break;
         case -1:
             return;
         case 'k':
@@ -916,6 +2656,24 @@ int main (int argc, char * const argv[])
     if (argc != optind + 2)
         usage (argv[0], stderr, EXIT_FAILURE);
 
+    if (watch_quiet != 0) {
+        if (output_path != NULL)
+            fatal ("--watch needs the output to go to git fast-import\n");
+        const char * root = cvs_local_root (argv[optind]);
+        if (root == NULL)
+            fatal ("--watch requires a local repository\n");
+        const char * prefix = module_prefix (root, argv[optind + 1]);
+        watch_fd = inotify_init1 (IN_CLOEXEC);
+        if (watch_fd < 0)
+            fatal ("inotify_init1 failed: %s\n", strerror (errno));
+        watch_tree (prefix);
+        xfree (prefix);
+        xfree (root);
+    }
+
+    if (!no_preload)
+        cvs_preload = find_preload();
+
     if (branch_prefix == NULL) {
         if (*remote)
             branch_prefix = cache_stringf ("refs/remotes/%s", remote);
@@ -941,6 +2699,12 @@ int main (int argc, char * const argv[])
         fatal("%s is not a valid CVS substitution mode\n", keyword_mode);
     }
 
+    fetch_keyword_mode = local_keywords ? "o" : keyword_mode;
+
+    if (blob_store_dir != NULL)
+        blob_store_init (&blob_store, blob_store_dir, fetch_keyword_mode,
+                         (unsigned long long) blob_store_limit << 20);
+
     // Set up git_dir.
     {
         pipeline * git_dir_pl = pipeline_new_command_args (
@@ -958,37 +2722,47 @@ int main (int argc, char * const argv[])
         pipeline_free (git_dir_pl);
     }
 
-    if (version_cache_path == NULL)
+    if (version_cache_path == NULL) {
         version_cache_path = cache_stringf (
+            "%s/crap/version-cache%s%s.bin",
+            git_dir, *remote ? "." : "", remote);
+        legacy_version_cache_path = cache_stringf (
             "%s/crap/version-cache%s%s.txt",
             git_dir, *remote ? "." : "", remote);
+    }
 
-    cvs_connection_t stream;
-    connect_to_cvs (&stream, argv[optind]);
-
-    if (zlevel != 0)
-        cvs_connection_compress (&stream, zlevel);
-
-    stream.module = xstrdup (argv[optind + 1]);
-    int root_len = strlen(stream.remote_root);
-    while (root_len > 0 && stream.remote_root[root_len - 1] == '/')
-        --root_len;
-    stream.prefix = xasprintf ("%.*s/%s/", root_len, stream.remote_root,
-                               stream.module);
-
-    cvs_printff (&stream,
-                 "Global_option -q\n"
-                 "Argument --\n");
-    if (directory_list == directory_list_end)
-        cvs_printff (&stream, "Argument %s\n", stream.module);
-    else
-        for (const char ** i = directory_list; i != directory_list_end; ++i)
-            cvs_printff (&stream, "Argument %s/%s\n", stream.module, *i);
-    cvs_printff (&stream, "rlog\n");
+    const char * snapshot_path = no_snapshot ? NULL : cache_stringf (
+        "%s/crap/snapshot%s%s.bin", git_dir, *remote ? "." : "", remote);
 
     database_t db;
 
-    read_files_versions (&db, &stream);
+    if (read_rcs) {
+        // Everything comes straight from the ,v files; no server needed.
+        rcs_root = cvs_local_root (argv[optind]);
+        if (rcs_root == NULL)
+            fatal ("--rcs requires a local repository\n");
+
+        const char * prefix = module_prefix (rcs_root, argv[optind + 1]);
+        read_rcs_files_versions (&db, prefix,
+                                 directory_list, directory_list_end, jobs,
+                                 snapshot_path);
+        xfree (prefix);
+    }
+    else {
+        connections = ARRAY_ALLOC (cvs_connection_t, jobs);
+        connections_end = connections + jobs;
+        for (cvs_connection_t * s = connections; s != connections_end; ++s)
+            open_connection (s, argv[optind], argv[optind + 1]);
+
+        read_files_versions (&db, connections, connections_end,
+                             directory_list, directory_list_end,
+                             snapshot_path);
+    }
+
+    if (delta_budget != 0 && connections != connections_end) {
+        delta_bases = ARRAY_CALLOC (delta_base_t, db.files_end - db.files);
+        delta_files = db.files;
+    }
 
     create_changesets (&db);
 
@@ -1046,6 +2820,24 @@ int main (int argc, char * const argv[])
         }
     }
 
+    // The commits to reuse are given to git fast-import as marks.
+    use_commit_cache = !no_commit_cache && output_path == NULL;
+    if (use_commit_cache) {
+        commit_cache_path = cache_stringf (
+            "%s/crap/commit-cache%s%s.txt", git_dir, *remote ? "." : "", remote);
+        stale_refs = ARRAY_CALLOC (bool, db.tags_end - db.tags);
+    }
+
+    if ((checkpoint_interval != 0 || resume) && output_path != NULL)
+        fatal ("--checkpoint and --resume need the output to go to "
+               "git fast-import\n");
+    if (resume && no_commit_cache)
+        fatal ("--resume reuses commits through the commit cache, so cannot "
+               "be used with --no-commit-cache\n");
+    if (output_path == NULL)
+        checkpoint_path = cache_stringf (
+            "%s/crap/checkpoint%s%s.txt", git_dir, *remote ? "." : "", remote);
+
     // Read in any cached version sha's.
     initial_process_marks (&db);
 
@@ -1080,14 +2872,36 @@ int main (int argc, char * const argv[])
 
     fprintf (out, "feature done\n");
 
+    if (read_rcs)
+        print_rcs_blobs (out, &db, serial, serial_end);
+    else if (blobs_first)
+        print_blobs (out, &db);
+
+    if (fetcher.queue_limit != 0 && connections != connections_end)
+        start_fetch_thread (&db, serial, serial_end);
+
     // Output the changesets to git-filter-branch.
     ssize_t emitted_commits = 0;
+    changeset_t ** prefetched = serial;
+    time_t next_checkpoint = time (NULL) + checkpoint_interval;
     for (changeset_t ** p = serial; p != serial_end; ++p) {
         changeset_t * changeset = *p;
+        if (checkpoint_interval != 0 && time (NULL) >= next_checkpoint) {
+            checkpoint (out, p - serial);
+            next_checkpoint = time (NULL) + checkpoint_interval;
+        }
+
+        if (lookahead != 0 && p == prefetched && !fetcher.running
+            && connections != connections_end) {
+            prefetched = (size_t) (serial_end - p) > lookahead
+                ? p + lookahead : serial_end;
+            prefetch_versions (out, &db, p, prefetched);
+        }
+
         if (changeset->type == ct_tag) {
             tag_t * tag = as_tag (changeset);
             tag->is_released = true;
-            print_tag (out, &db, tag, &stream);
+            print_tag (out, &db, tag);
             continue;
         }
 
@@ -1096,8 +2910,7 @@ int main (int argc, char * const argv[])
         // Before doing the commit proper, output any branch-fixups that need
         // doing.
         tag_t * branch = changeset->versions[0]->branch;
-        print_fixups (out, &db, branch->branch_versions, branch,
-                      changeset, &stream);
+        print_fixups (out, &db, branch->branch_versions, branch, changeset);
 
         bool live = false;
         for (version_t ** i = changeset->versions;
@@ -1112,25 +2925,43 @@ int main (int argc, char * const argv[])
             }
 
         if (live) {
-            print_commit (out, &db, changeset, &stream);
+            print_commit (out, &db, changeset);
         }
         else {
             changeset->mark = branch->last->mark;
             branch->last = changeset;
         }
     }
-    free (serial);
 
     // Final fixups.
     for (tag_t * i = db.tags; i != db.tags_end; ++i)
         if (i->branch_versions)
-            print_fixups (out, &db, i->branch_versions, i, NULL, &stream);
+            print_fixups (out, &db, i->branch_versions, i, NULL);
+
+    if (fetcher.running)
+        stop_fetch_thread (out);
+    free (serial);
+
+    // Point any refs left at reused commits.
+    for (tag_t * i = db.tags; stale_refs && i != db.tags_end; ++i)
+        if (stale_refs[i - db.tags])
+            fprintf (out, "reset %s/%s\nfrom :%zu\n",
+                     i->branch_versions ? branch_prefix : tag_prefix,
+                     *i->tag ? i->tag : master, i->changeset.mark);
 
     fprintf (stderr,
              "Emitted %zu commits (%s total %zu).\n",
              emitted_commits,
              emitted_commits == db.changesets_end - db.changesets ? "=" : "!=",
              db.changesets_end - db.changesets);
+    if (use_commit_cache)
+        fprintf (stderr, "Reused %zu commits from the commit cache.\n",
+                 reused_commits);
+    if (version_cache.record && reused_blobs != 0)
+        fprintf (stderr, "Skipped %zu blobs already sent.\n", reused_blobs);
+    if (blob_store_dir != NULL)
+        fprintf (stderr, "Read %zu blobs from the blob store, stored %zu.\n",
+                 blob_store.hits, blob_store.stored);
 
     size_t exact_branches = 0;
     size_t fixup_branches = 0;
@@ -1160,9 +2991,15 @@ int main (int argc, char * const argv[])
              exact_branches, exact_tags, exact_branches + exact_tags,
              fixup_branches, fixup_tags, fixup_branches + fixup_tags);
 
+    unsigned long count_versions = 0;
+    unsigned long count_transactions = 0;
+    for (cvs_connection_t * s = connections; s != connections_end; ++s) {
+        count_versions += s->count_versions;
+        count_transactions += s->count_transactions;
+    }
     fprintf (stderr,
              "Download %lu cvs versions in %lu transactions.\n",
-             stream.count_versions, stream.count_transactions);
+             count_versions, count_transactions);
 
     string_cache_stats (stderr);
 
@@ -1175,12 +3012,20 @@ int main (int argc, char * const argv[])
         if (status != 0)
             fatal ("Import command exited with %i.\n", status);
         pipeline_free (pipeline);
-        final_process_marks (&db);
+        final_process_marks();
+        // Everything is in git now, so there is nothing to resume.
+        if (checkpoint_log != NULL)
+            fclose (checkpoint_log);
+        unlink (checkpoint_path);
     }
     else {
         fclose (out);
     }
 
+    version_cache_finish (&version_cache);
+    if (blob_store_dir != NULL)
+        blob_store_trim (&blob_store);
+
     if (deleted_fixup) {
         int ret = pipeline_run (
                 pipeline_new_command_args (
@@ -1189,10 +3034,34 @@ int main (int argc, char * const argv[])
             fatal ("Deleting dummy ref failed: %i\n", ret);
     }
 
-    cvs_connection_destroy (&stream);
+    for (cvs_connection_t * s = connections; s != connections_end; ++s)
+        cvs_connection_destroy (s);
+    xfree (connections);
+    xfree (rcs_root);
+    xfree (cvs_preload);
+
+    if (delta_bases)
+        for (file_t * i = db.files; i != db.files_end; ++i)
+            free (delta_bases[i - db.files].text);
+    xfree (delta_bases);
+
+    if (use_commit_cache)
+        string_hash_destroy (&commit_cache);
+    free (commit_keys);
+    free (stale_refs);
 
     database_destroy (&db);
     string_cache_destroy();
 
+    if (watch_fd >= 0) {
+        // The snapshot and caches make the next run cheap: only the changed
+        // files are read, and only the new commits written.
+        fprintf (stderr, "Watching for changes.\n");
+        wait_for_changes();
+        fprintf (stderr, "Repository changed; importing again.\n");
+        execv ("/proc/self/exe", argv);
+        fatal ("re-running %s failed: %s\n", argv[0], strerror (errno));
+    }
+
     return 0;
 }
@@ -8,20 +8,61 @@
 #include <limits.h>
 #include <netdb.h>
 #include <pipeline.h>
+#include <poll.h>
 #include <string.h>
 #include <stdarg.h>
 #include <stdlib.h>
+#include <sys/uio.h>
+#include <time.h>
 #include <unistd.h>
 
-static inline unsigned char * in_max (cvs_connection_t * s)
+size_t cvs_buffer_size = 256 << 10;
+
+// For --compress=auto: judge the link on this much data, and time zlib on a
+// sample this big.
+#define ADAPT_BYTES (4 << 20)
+#define ADAPT_SAMPLE (256 << 10)
+const char * cvs_preload;
+
+
+static inline unsigned char * out_max (cvs_connection_t * s)
 {
-    return s->in + sizeof s->in;
+    return s->out + s->out_size;
 }
 
 
-static inline unsigned char * out_max (cvs_connection_t * s)
+/// The number of bytes of unread data that are contiguous from @c in_start.
+static inline size_t in_contiguous (const cvs_connection_t * s)
+{
+    size_t tail = s->in_size - s->in_start;
+    return s->in_len < tail ? s->in_len : tail;
+}
+
+
+/// Mark @c n bytes of input as used.
+static void in_consume (cvs_connection_t * s, size_t n)
+{
+    assert (n <= s->in_len);
+    s->in_start += n;
+    if (s->in_start >= s->in_size)
+        s->in_start -= s->in_size;
+    s->in_len -= n;
+    if (s->in_len == 0)
+        s->in_start = 0;                // Keep the free space contiguous.
+}
+
+
+/// Double the size of the input buffer, unwrapping the data.
+static void in_grow (cvs_connection_t * s)
 {
-    return s->out + sizeof s->out;
+    unsigned char * in = xmalloc (2 * s->in_size);
+    size_t first = in_contiguous (s);
+    memcpy (in, s->in + s->in_start, first);
+    memcpy (in + first, s->in, s->in_len - first);
+    free (s->in);
+    s->in = in;
+    s->in_size *= 2;
+    s->in_start = 0;
 }
 
 
@@ -167,27 +208,69 @@ static void connect_to_program (cvs_connection_t * restrict conn,
     va_end (argv);
     pipeline_want_in (conn->pipeline, sockets[1]);
     pipeline_want_out (conn->pipeline, sdup);
+
+    if (conn->local && cvs_preload != NULL) {
+        const char * old = getenv ("LD_PRELOAD");
+        const char * preload = old && *old
+            ? xasprintf ("%s %s", cvs_preload, old) : xstrdup (cvs_preload);
+        pipecmd_setenv (pipeline_get_command (conn->pipeline, 0),
+                        "LD_PRELOAD", preload);
+        xfree (preload);
+    }
+
     pipeline_start (conn->pipeline);
 
     conn->socket = sockets[0];
 }
 
 
+/// If @c root names a repository on this machine, return the path part of it,
+/// otherwise NULL.
+static const char * local_path (const char * root)
+{
+    if (starts_with (root, ":local:"))
+        return root + 7;
+    if (starts_with (root, ":fork:"))
+        return root + 6;
+    if (starts_with (root, "./"))
+        // CVS would try and interpret ./foo as host "." and path "/foo".  But
+        // "." has no A or AAAA DNS records, so it is safe to take this as a
+        // relative path.
+        return root;
+    if (root[0] == ':' || (root[0] != '/' && root[strcspn (root, "/:")]))
+        return NULL;
+    return root;
+}
+
+
+static const char * absolute_path (const char * path)
+{
+    if (path[0] == '/')
+        return xstrdup (path);
+
+    const char * cwd = getcwd(NULL, 0);
+    if (cwd == NULL)
+        fatal("getcwd() failed: %m");
+    const char * sep = "";
+    if (path[0] && !ends_with(cwd, "/"))
+        sep = "/";
+    const char * result = xasprintf("%s%s%s", cwd, sep, path);
+    xfree(cwd);
+    return result;
+}
+
+
+const char * cvs_local_root (const char * root)
+{
+    const char * path = local_path (root);
+    return path ? absolute_path (path) : NULL;
+}
+
+
 static void connect_to_fork (cvs_connection_t * conn, const char * path)
 {
-    if (path[0] == '/') {
-        conn->remote_root = xstrdup(path);
-    }
-    else {
-        const char * cwd = getcwd(NULL, 0);
-        if (cwd == NULL)
-            fatal("getcwd() failed: %m");
-        const char * sep = "";
-        if (path[0] && !ends_with(cwd, "/"))
-            sep = "/";
-        conn->remote_root = xasprintf("%s%s%s", cwd, sep, path);
-        xfree(cwd);
-    }
+    conn->remote_root = absolute_path (path);
+    conn->local = true;
     connect_to_program (conn, "cvs", "server", NULL);
 }
 
@@ -242,38 +325,54 @@ void connect_to_cvs (cvs_connection_t * conn, const char * root)
     conn->log = NULL;
     conn->pipeline = NULL;
     conn->compress = false;
+    conn->local = false;
+    conn->no_splice = false;
+    conn->tee_pipe[0] = -1;
+    conn->tee_pipe[1] = -1;
+    conn->compress_auto = false;
+    conn->read_bytes = 0;
+    conn->read_time = 0;
+    conn->burst = false;
+    conn->read_start = 0;
+    conn->sample = NULL;
+    conn->sample_len = 0;
+    conn->sent_bytes = 0;
 
     const char * client_log = getenv ("CVS_CLIENT_LOG");
     if (client_log)
         conn->log = fopen (client_log, "we");
 
-    conn->in_next = conn->in;
-    conn->in_end = conn->in;
+    conn->in_size = cvs_buffer_size;
+    conn->in = xmalloc (conn->in_size);
+    conn->in_start = 0;
+    conn->in_len = 0;
+    conn->line_buf = NULL;
+    conn->line_buf_size = 0;
+    conn->out_size = cvs_buffer_size;
+    conn->out = xmalloc (conn->out_size);
     conn->out_next = conn->out;
+    conn->plain = xmalloc (conn->out_size);
+    conn->plain_len = 0;
+    conn->zin_size = cvs_buffer_size;
+    conn->zin = xmalloc (conn->zin_size);
+
+    string_hash_init (&conn->directories);
 
     conn->module = NULL;
     conn->prefix = NULL;
     conn->remote_root = NULL;
 
-    if (starts_with (root, ":pserver:"))
+    const char * path = local_path (root);
+    if (path != NULL)
+        connect_to_fork (conn, path);
+    else if (starts_with (root, ":pserver:"))
         connect_to_pserver (conn, root);
     else if (starts_with (root, ":fake:"))
         connect_to_fake (conn, root);
     else if (starts_with (root, ":ext:"))
         connect_to_ext (conn, root, root + 5);
-    else if (starts_with(root, ":local:"))
-        connect_to_fork(conn, root + 7);
-    else if (starts_with(root, ":fork:"))
-        connect_to_fork(conn, root + 6);
-    else if (starts_with(root, "./"))
-        // CVS would try and interpret ./foo as host "." and path "/foo".  But
-        // "." has no A or AAAA DNS records, so it is safe to take this as a
-        // relative path.
-        connect_to_fork(conn, root);
-    else if (root[0] != '/' && root[strcspn(root, "/:")])
-        connect_to_ext (conn, root, root);
     else
-        connect_to_fork (conn, root);
+        connect_to_ext (conn, root, root);
 
     cvs_printff (conn,
                  "Root %s\n"
@@ -318,23 +417,13 @@ static size_t checked_read (cvs_connection_t * s, void * buf, size_t count)
 }
 
 
-static void do_read (cvs_connection_t * s)
+/// Decompress some data from the server into @c buf, reading the server as
+/// needed.  Returns the number of bytes placed in @c buf, at least one.
+static size_t inflate_some (cvs_connection_t * s,
+                            unsigned char * buf, size_t len)
 {
-    if (s->in_end == in_max (s)) {
-        // Shuffle data.
-        assert (s->in_next != s->in);
-        size_t bytes = s->in_end - s->in_next;
-        memmove (s->in, s->in_next, bytes);
-        s->in_next = s->in;
-        s->in_end = s->in + bytes;
-    }
-    if (!s->compress) {
-        s->in_end += checked_read (s, s->in_end, in_max (s) - s->in_end);
-        return;
-    }
-
-    s->inflater.next_out = s->in_end;
-    s->inflater.avail_out = in_max (s) - s->in_end;
+    s->inflater.next_out = buf;
+    s->inflater.avail_out = len;
     while (1) {
         // Unfortunately, we can't just look at avail_in and avail_out to tell
         // if we need to read from the socket, because some data might be
@@ -344,34 +433,167 @@ static void do_read (cvs_connection_t * s)
         if (r == Z_MEM_ERROR)
             fatal ("Out-of-memory decompressing data from CVS");
 
-        if (s->in_end != s->inflater.next_out) {
-            s->in_end = s->inflater.next_out;
-            return;
-        }
+        if (s->inflater.next_out != buf)
+            return s->inflater.next_out - buf;
 
         assert (s->inflater.avail_out != 0);
         assert (s->inflater.avail_in == 0);
-        s->inflater.avail_in = checked_read (s, s->zin, sizeof s->zin);
+        s->inflater.avail_in = checked_read (s, s->zin, s->zin_size);
         s->inflater.next_in = s->zin;
     }
 }
 
 
+/// Monotonic time in nanoseconds.
+static unsigned long long now (void)
+{
+    struct timespec ts;
+    clock_gettime (CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+
+/// With compress_auto, before a read that may block.  At the start of a burst,
+/// wait for the server's first byte with the clock stopped: until then, the
+/// server is working, and the link is idle.
+static void burst_wait (cvs_connection_t * s)
+{
+    if (!s->compress_auto)
+        return;
+
+    if (!s->burst) {
+        struct pollfd p = { .fd = s->socket, .events = POLLIN };
+        while (poll (&p, 1, -1) < 0)
+            if (errno != EINTR)
+                fatal ("Waiting for CVS server failed: %s\n",
+                       strerror (errno));
+        s->burst = true;
+    }
+    s->read_start = now();
+}
+
+
+/// With compress_auto, count @c bytes just read, keeping a sample of the data
+/// if @c data is not NULL.
+static void burst_read (cvs_connection_t * s,
+                        const unsigned char * data, size_t bytes)
+{
+    if (!s->compress_auto)
+        return;
+
+    s->read_time += now() - s->read_start;
+    s->read_start = now();
+    s->read_bytes += bytes;
+
+    if (data == NULL || s->sample_len == ADAPT_SAMPLE)
+        return;
+    if (s->sample == NULL)
+        s->sample = xmalloc (ADAPT_SAMPLE);
+    size_t n = bytes < ADAPT_SAMPLE - s->sample_len
+        ? bytes : ADAPT_SAMPLE - s->sample_len;
+    memcpy (s->sample + s->sample_len, data, n);
+    s->sample_len += n;
+}
+
+
+/// Read more data from the server into the free space of the input buffer,
+/// which must not be full.
+static void do_read (cvs_connection_t * s)
+{
+    assert (s->in_len < s->in_size);
+
+    // The free space starts after the data, and may wrap around.
+    size_t end = s->in_start + s->in_len;
+    if (end >= s->in_size)
+        end -= s->in_size;
+
+    struct iovec iov[2];
+    int iov_count = 1;
+    iov[0].iov_base = s->in + end;
+    if (end < s->in_start)
+        iov[0].iov_len = s->in_start - end;
+    else {
+        iov[0].iov_len = s->in_size - end;
+        iov[1].iov_base = s->in;
+        iov[1].iov_len = s->in_start;
+        if (s->in_start != 0)
+            iov_count = 2;
+    }
+
+    if (!s->compress) {
+        burst_wait (s);
+        size_t r = check (readv (s->socket, iov, iov_count),
+                          "Reading from CVS server");
+        if (r == 0)
+            fatal ("Unexpected EOF from CVS server.\n");
+        s->in_len += r;
+        if (r <= iov[0].iov_len)
+            burst_read (s, iov[0].iov_base, r);
+        else {
+            burst_read (s, iov[0].iov_base, iov[0].iov_len);
+            burst_read (s, iov[1].iov_base, r - iov[0].iov_len);
+        }
+        return;
+    }
+
+    s->in_len += inflate_some (s, iov[0].iov_base, iov[0].iov_len);
+}
+
+
 static size_t next_line_raw (cvs_connection_t * s)
 {
-    char * nl;
-    while (s->in_end == s->in_next
-           || (nl = memchr (s->in_next, '\n',
-                            s->in_end - s->in_next)) == NULL) {
-        if (s->in_end == in_max (s) && s->in_next == s->in)
-            fatal ("Line from CVS server is too long.\n");
+    // The number of bytes from in_start known not to contain a newline.
+    size_t scanned = 0;
+    while (1) {
+        unsigned char * data = s->in + s->in_start;
+        size_t first = in_contiguous (s);
+        if (scanned < first) {
+            unsigned char * nl = memchr (data + scanned, '\n', first - scanned);
+            if (nl != NULL) {
+                size_t len = nl - data;
+                *nl = 0;
+                s->line = (char *) data;
+                in_consume (s, len + 1);
+                return len;
+            }
+            scanned = first;
+        }
+
+        if (scanned < s->in_len) {
+            // Look in the part that has wrapped around.
+            unsigned char * nl = memchr (s->in + (scanned - first), '\n',
+                                         s->in_len - scanned);
+            if (nl != NULL) {
+                // Copy the line, so that it is contiguous.
+                size_t len = first + (nl - s->in);
+                if (len >= s->line_buf_size) {
+                    s->line_buf_size = 2 * len + 1;
+                    s->line_buf = xrealloc (s->line_buf, s->line_buf_size);
+                }
+                memcpy (s->line_buf, data, first);
+                memcpy (s->line_buf + first, s->in, nl - s->in);
+                s->line_buf[len] = 0;
+                s->line = s->line_buf;
+                in_consume (s, len + 1);
+                return len;
+            }
+            scanned = s->in_len;
+        }
+
+        if (s->in_len == s->in_size)
+            in_grow (s);                // A long line.
+
         do_read (s);
     }
+}
+
 
-    *nl = 0;
-    s->line = (char *) s->in_next;
-    s->in_next = (unsigned char *) nl + 1;
-    return nl - s->line;
+bool cvs_input_pending (const cvs_connection_t * s)
+{
+    // zlib may be holding output if the last inflate filled the buffer.
+    return s->in_len != 0
+        || (s->compress && (s->inflater.avail_in != 0
+                            || s->inflater.avail_out == 0));
 }
 
 
@@ -394,6 +616,7 @@ size_t next_line (cvs_connection_t * s)
 static void do_write (cvs_connection_t * s,
                       const unsigned char * data, size_t length)
 {
+    s->burst = false;                   // The server has more work.
     while (length) {
         ssize_t r = check (write (s->socket, data, length),
                            "Write to CVS server");
@@ -405,38 +628,55 @@ static void do_write (cvs_connection_t * s,
 }
 
 
-
-static void cvs_send (cvs_connection_t * s, const unsigned char * data,
-                      size_t length, int flush)
+/// Write the output buffer followed by @c data, in one system call if we can.
+static void do_write_gathered (cvs_connection_t * s,
+                               const unsigned char * data, size_t length)
 {
-    assert (length <= INT_MAX);
+    struct iovec iov[2] = {
+        { s->out, s->out_next - s->out },
+        { (unsigned char *) data, length },
+    };
+    s->out_next = s->out;
+    s->burst = false;                   // The server has more work.
 
-    if (!s->compress) {
-        if (length > (size_t) (out_max (s) - s->out_next)) {
-            // Flush current data.
-            do_write (s, s->out, s->out_next - s->out);
-            s->out_next = s->out;
-        }
-        if (length > (size_t) (out_max (s) - s->out_next))
-            // Do big writes immediately.
-            do_write (s, data, length);
-        else {
-            memcpy (s->out_next, data, length);
-            s->out_next += length;
+    struct iovec * v = iov;
+    while (v != iov + 2) {
+        ssize_t r = check (writev (s->socket, v, iov + 2 - v),
+                           "Write to CVS server");
+        if (r == 0)
+            fatal ("Huh?  Write to CVS returns 0\n");
+        for (; v != iov + 2 && (size_t) r >= v->iov_len; ++v)
+            r -= v->iov_len;
+        if (v != iov + 2) {
+            v->iov_base = (unsigned char *) v->iov_base + r;
+            v->iov_len -= r;
         }
-        return;
     }
+}
+
+
+static void out_flush (cvs_connection_t * s)
+{
+    do_write (s, s->out, s->out_next - s->out);
+    s->out_next = s->out;
+}
+
+
+/// Compress @c length bytes at @c data into the output buffer, writing it out
+/// as it fills.
+static void do_deflate (cvs_connection_t * s, const unsigned char * data,
+                        size_t length, int flush)
+{
+    assert (length <= INT_MAX);
 
     s->deflater.next_in = (unsigned char *) data; // Zlib isn't const-correct.
     s->deflater.avail_in = length;
 
     int r;
     do {
-        if (s->out_next == out_max (s)) {
+        if (s->out_next == out_max (s))
             // Buffer is full; flush.
-            do_write (s, s->out, s->out_next - s->out);
-            s->out_next = s->out;
-        }
+            out_flush (s);
 
         s->deflater.next_out = s->out_next;
         s->deflater.avail_out = out_max (s) - s->out_next;
@@ -456,22 +696,93 @@ static void cvs_send (cvs_connection_t * s, const unsigned char * data,
 }
 
 
+/// Compress the text waiting in @c plain.
+static void plain_flush (cvs_connection_t * s, int flush)
+{
+    if (s->plain_len == 0 && flush == Z_NO_FLUSH)
+        return;                         // Zlib objects to doing nothing.
+    do_deflate (s, s->plain, s->plain_len, flush);
+    s->plain_len = 0;
+}
+
+
+/// Where the next text to send is formatted: the output buffer, or, if we are
+/// compressing, the text waiting to be compressed.
+static inline char * text_next (cvs_connection_t * s, size_t * room)
+{
+    if (s->compress) {
+        *room = s->out_size - s->plain_len;
+        return (char *) s->plain + s->plain_len;
+    }
+
+    *room = out_max (s) - s->out_next;
+    return (char *) s->out_next;
+}
+
+
 static void cvs_do_printf (cvs_connection_t * s, int flush,
                            const char * format, va_list args)
 {
-    if (s->log) {
-        va_list copy;
-        va_copy (copy, args);
-        vfprintf (s->log, format, copy); // Ignore errors.
-        va_end (copy);
+    // Format straight into the buffer.  If it doesn't fit, make room and try
+    // again.
+    size_t room;
+    char * text = text_next (s, &room);
+    va_list copy;
+    va_copy (copy, args);
+    size_t len = check (vsnprintf (text, room, format, copy),
+                        "Formatting string");
+    va_end (copy);
+
+    if (len >= room) {
+        if (s->compress)
+            plain_flush (s, Z_NO_FLUSH);
+        else
+            out_flush (s);
+        text = text_next (s, &room);
+        if (len < room)
+            vsnprintf (text, room, format, args);
     }
 
-    // FIXME - this takes an extra copy of the data.
-    char * string;
-    int len = check (vasprintf (&string, format, args), "Formatting string");
+    char * string = NULL;
+    if (len >= room) {
+        // Bigger than the buffer; do it the slow way.
+        check (vasprintf (&string, format, args), "Formatting string");
+        text = string;
+    }
+
+    s->sent_bytes += len;
+    if (s->log)
+        fwrite (text, len, 1, s->log); // Ignore errors.
 
-    cvs_send (s, (const unsigned char *) string, len, flush);
-    free (string);
+    if (string != NULL) {
+        if (s->compress)
+            do_deflate (s, (const unsigned char *) string, len, flush);
+        else
+            do_write_gathered (s, (const unsigned char *) string, len);
+        free (string);
+    }
+    else if (s->compress) {
+        s->plain_len += len;
+        if (flush != Z_NO_FLUSH)
+            plain_flush (s, flush);
+    }
+    else
+        s->out_next += len;
+}
+
+
+bool cvs_directory (cvs_connection_t * s, const char * dir, size_t len,
+                    bool force)
+{
+    bool added;
+    string_hash_insert (&s->directories, cache_string_n (dir, len),
+                        sizeof (string_hash_head_t), &added);
+    if (!added && !force)
+        return false;
+
+    cvs_printf (s, "Directory %s/%.*s\n%s%.*s\n",
+                s->module, (int) len, dir, s->prefix, (int) len, dir);
+    return true;
 }
 
 
@@ -491,8 +802,7 @@ void cvs_printff (cvs_connection_t * s, const char * format, ...)
     cvs_do_printf (s, Z_SYNC_FLUSH, format, args);
     va_end (args);
 
-    do_write (s, s->out, s->out_next - s->out);
-    s->out_next = s->out;
+    out_flush (s);
 }
 
 
@@ -501,8 +811,19 @@ void cvs_connection_destroy (cvs_connection_t * s)
     xfree (s->module);
     xfree (s->prefix);
     xfree (s->remote_root);
+    free (s->in);
+    free (s->line_buf);
+    free (s->out);
+    free (s->plain);
+    free (s->zin);
+    free (s->sample);
+    string_hash_destroy (&s->directories);
 
     close (s->socket);
+    if (s->tee_pipe[0] >= 0) {
+        close (s->tee_pipe[0]);
+        close (s->tee_pipe[1]);
+    }
     if (s->log)
         fclose (s->log);
 
@@ -521,28 +842,163 @@ void cvs_connection_destroy (cvs_connection_t * s)
 }
 
 
+/// Move @c bytes of data straight from the server to @c f, without copying
+/// it through user space.  This only works if one end is a pipe; returns the
+/// number of bytes moved, which is zero if splice() is not possible.
+static size_t splice_block (cvs_connection_t * s, FILE * f, size_t bytes)
+{
+    int fd = fileno (f);
+    if (s->no_splice || fd < 0)
+        return 0;                       // E.g., f is a memory stream.
+
+    if (fflush (f) != 0)
+        fatal ("git import interrupted: %s\n", file_error (f));
+
+    size_t done = 0;
+    while (done != bytes) {
+        burst_wait (s);
+        ssize_t r = splice (s->socket, NULL, fd, NULL, bytes - done,
+                            SPLICE_F_MOVE | SPLICE_F_MORE);
+        if (r < 0 && errno == EINTR)
+            continue;
+        if (r < 0 && (errno == EINVAL || errno == ENOSYS)) {
+            // Neither end is a pipe, or the socket can't splice.  Don't try
+            // again.
+            s->no_splice = true;
+            break;
+        }
+        check (r, "Moving data from CVS server");
+        if (r == 0)
+            fatal ("Unexpected EOF from CVS server.\n");
+        burst_read (s, NULL, r);
+        done += r;
+    }
+    return done;
+}
+
+
+/// Read exactly @c bytes from the pipe @c fd into @c buf.
+static void read_pipe (int fd, unsigned char * buf, size_t bytes)
+{
+    for (size_t done = 0; done != bytes; ) {
+        ssize_t r = read (fd, buf + done, bytes - done);
+        if (r < 0 && errno == EINTR)
+            continue;
+        check (r, "Reading spliced data");
+        if (r == 0)
+            fatal ("Spliced data went missing.\n");
+        done += r;
+    }
+}
+
+
+/// As @ref splice_block, also adding the data to @c hash.  The data goes
+/// through a pipe of ours: tee() copies it on to @c f without consuming it,
+/// and then we read it back to hash.  That is still one copy fewer than going
+/// through the input buffer.
+static size_t splice_block_sha1 (cvs_connection_t * s, FILE * f, size_t bytes,
+                                 sha1_t * hash)
+{
+    int fd = fileno (f);
+    if (s->no_splice || fd < 0)
+        return 0;                       // E.g., f is a memory stream.
+
+    if (s->tee_pipe[0] < 0 && pipe2 (s->tee_pipe, O_CLOEXEC) != 0) {
+        s->no_splice = true;
+        return 0;
+    }
+
+    if (fflush (f) != 0)
+        fatal ("git import interrupted: %s\n", file_error (f));
+
+    unsigned char buf[65536];
+    size_t done = 0;
+    while (done != bytes && !s->no_splice) {
+        size_t chunk = bytes - done < sizeof buf ? bytes - done : sizeof buf;
+        burst_wait (s);
+        ssize_t r = splice (s->socket, NULL, s->tee_pipe[1], NULL, chunk,
+                            SPLICE_F_MOVE | SPLICE_F_MORE);
+        if (r < 0 && errno == EINTR)
+            continue;
+        if (r < 0 && (errno == EINVAL || errno == ENOSYS)) {
+            s->no_splice = true;        // The socket can't splice.
+            break;
+        }
+        check (r, "Moving data from CVS server");
+        if (r == 0)
+            fatal ("Unexpected EOF from CVS server.\n");
+        burst_read (s, NULL, r);
+
+        // tee() always copies from the front of the pipe, so consume each
+        // piece copied before the next.
+        for (size_t left = r; left != 0; ) {
+            ssize_t t = tee (s->tee_pipe[0], fd, left, 0);
+            if (t < 0 && errno == EINTR)
+                continue;
+            bool teed = true;
+            if (t < 0 && errno == EINVAL) {
+                // f is not a pipe; write this lot out by hand, and stop.
+                s->no_splice = true;
+                teed = false;
+                t = left;
+            }
+            check (t, "Moving data to git import");
+            if (t == 0)
+                fatal ("Moving data to git import stalled.\n");
+            read_pipe (s->tee_pipe[0], buf, t);
+            sha1_update (hash, buf, t);
+            if (!teed && fwrite (buf, t, 1, f) != 1)
+                fatal ("git import interrupted: %s\n", file_error (f));
+            left -= t;
+        }
+        done += r;
+    }
+    return done;
+}
+
+
 void cvs_read_block (cvs_connection_t * s, FILE * f, size_t bytes)
+{
+    cvs_read_block_sha1 (s, f, bytes, NULL);
+}
+
+
+void cvs_read_block_sha1 (cvs_connection_t * s, FILE * f, size_t bytes,
+                          sha1_t * hash)
 {
     size_t done = 0;
     while (1) {
-        size_t avail = s->in_end - s->in_next;
+        size_t avail = in_contiguous (s);
         if (avail > bytes - done)
             avail = bytes - done;
 
-        if (avail != 0 && f != NULL && fwrite (s->in_next, avail, 1, f) != 1)
+        if (avail != 0 && f != NULL
+            && fwrite (s->in + s->in_start, avail, 1, f) != 1)
             fatal ("git import interrupted [%zu %u]: %s\n",
                    avail, 1, file_error (f));
 
+        if (hash != NULL)
+            sha1_update (hash, s->in + s->in_start, avail);
+
         done += avail;
-        s->in_next += avail;
-        if (s->in_next == s->in_end) {
-            s->in_next = s->in;
-            s->in_end = s->in;
-        }
+        in_consume (s, avail);
 
         if (done == bytes)
             break;
 
+        if (s->in_len != 0)
+            continue;                   // Data wrapped around.
+
+        // The buffer is empty; try and move the rest in bulk, once we have
+        // the sample for --compress=auto.
+        if (f != NULL && !s->compress
+            && (!s->compress_auto || s->sample_len == ADAPT_SAMPLE)) {
+            done += hash == NULL ? splice_block (s, f, bytes - done)
+                : splice_block_sha1 (s, f, bytes - done, hash);
+            if (done == bytes)
+                break;
+        }
+
         do_read (s);
     }
 
@@ -569,9 +1025,103 @@ void cvs_connection_compress (cvs_connection_t * s, int level)
     s->inflater.opaque = Z_NULL;
     s->inflater.next_in = Z_NULL;
     s->inflater.avail_in = 0;
+    s->inflater.avail_out = 0;
 
     if (inflateInit (&s->inflater) != Z_OK)
         fatal ("failed to initialise compression\n");
 
     s->compress = true;
 }
+
+
+void cvs_connection_compress_auto (cvs_connection_t * s)
+{
+    s->compress_auto = !s->local && !s->compress;
+    s->read_bytes = 0;
+    s->read_time = 0;
+    s->burst = false;
+    s->sample_len = 0;
+}
+
+
+/// CPU time used by this thread, in nanoseconds.
+static unsigned long long cpu_now (void)
+{
+    struct timespec ts;
+    clock_gettime (CLOCK_THREAD_CPUTIME_ID, &ts);
+    return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+
+/// Compress the sample of @c s at @c level and back again.  Returns the
+/// compressed size, and sets the CPU time of each direction.
+static size_t try_level (const cvs_connection_t * s, int level,
+                         unsigned long long * deflate_time,
+                         unsigned long long * inflate_time)
+{
+    uLongf packed_len = compressBound (s->sample_len);
+    unsigned char * packed = xmalloc (packed_len);
+    unsigned char * unpacked = xmalloc (s->sample_len);
+
+    unsigned long long start = cpu_now();
+    if (compress2 (packed, &packed_len,
+                   s->sample, s->sample_len, level) != Z_OK)
+        fatal ("Compressing a sample of the CVS data failed\n");
+    unsigned long long middle = cpu_now();
+    uLongf unpacked_len = s->sample_len;
+    if (uncompress (unpacked, &unpacked_len, packed, packed_len) != Z_OK)
+        fatal ("Decompressing a sample of the CVS data failed\n");
+    unsigned long long end = cpu_now();
+
+    *deflate_time = middle - start;
+    *inflate_time = end - middle;
+    free (packed);
+    free (unpacked);
+    return packed_len;
+}
+
+
+void cvs_connection_adapt (cvs_connection_t * s)
+{
+    if (!s->compress_auto || s->read_bytes < ADAPT_BYTES)
+        return;
+
+    if (s->in_len != 0)
+        return;                         // Not at a request boundary.
+
+    // Bytes per second while streaming.
+    double rate = s->read_time
+        ? s->read_bytes * 1e9 / s->read_time : 1e12;
+
+    // Nanoseconds per byte of CVS data at each level.  The link carries the
+    // compressed data while the server deflates and we inflate, so the
+    // slowest of the three sets the pace; our deflate of the sample stands in
+    // for the server's.  A higher level must be a clear win over a lower one.
+    static const int levels[] = { 1, 6, 9 };
+    double best = 1e9 / rate;
+    int level = 0;
+    size_t tries = s->sample_len != 0 ? sizeof levels / sizeof levels[0] : 0;
+    for (size_t i = 0; i != tries; ++i) {
+        unsigned long long deflate_time;
+        unsigned long long inflate_time;
+        size_t packed = try_level (s, levels[i], &deflate_time, &inflate_time);
+        double cost = packed * 1e9 / rate;
+        if (cost < deflate_time)
+            cost = deflate_time;
+        if (cost < inflate_time)
+            cost = inflate_time;
+        cost /= s->sample_len;
+        if (cost * 1.1 < best) {
+            best = cost;
+            level = levels[i];
+        }
+    }
+
+    fprintf (stderr, "CVS server %.0f KiB/s; compression level %d\n",
+             rate / 1024, level);
+    s->compress_auto = false;
+    free (s->sample);
+    s->sample = NULL;
+    if (level != 0)
+        cvs_connection_compress (s, level);
+}
@@ -1,6 +1,9 @@
 #ifndef CVS_H
 #define CVS_H
 
+#include "sha1.h"
+#include "string_cache.h"
+
 #include <stdio.h>
 #include <stdbool.h>
 #include <sys/types.h>
@@ -15,14 +18,6 @@ typedef struct cvs_connection {
     /// Last input line; nul-terminated.
     char * line;
 
-    /// The start of the unused data in line_buf.  This is only used when
-    /// inflating a compressed stream.
-    char * line_next;
-
-    /// The end of the unused data in line_buf.  This is only used when
-    /// inflating a compressed stream.
-    char * line_end;
-
     unsigned long count_versions;
     unsigned long count_transactions;
 
@@ -31,29 +26,96 @@ typedef struct cvs_connection {
     struct pipeline * pipeline;
 
     bool compress;                      ///< Are we compressing?
+    bool local;                   ///< Is remote_root a path on this machine?
+    bool no_splice;                     ///< Has splice() failed?
+    /// A pipe of our own, for splicing data that we also need to see; -1s
+    /// until needed.
+    int tee_pipe[2];
+    bool compress_auto;           ///< Choose compression from the link speed.
+
+    /// For choosing compression: bytes read from the server, and the time
+    /// spent reading them, in nanoseconds.  The first read of each burst is
+    /// timed from the server's first byte, not from the request, so that the
+    /// server's own work is left out; a burst ends when we next write.
+    size_t read_bytes;
+    unsigned long long read_time;
+    bool burst;                         ///< Has the server started replying?
+    unsigned long long read_start;      ///< When the current read started.
+    /// The first data read, for timing zlib on.
+    unsigned char * sample;
+    size_t sample_len;
+
+    /// Request text sent so far, before any compression.
+    unsigned long long sent_bytes;
 
     z_stream deflater;                ///< State for compressing data to server.
     z_stream inflater;            ///< State for decompressing data from server.
 
-    unsigned char * in_next;            ///< Next available input byte.
-    unsigned char * in_end;             ///< End of available input data.
+    /// Input ring buffer.  The unread data is the @c in_len bytes from @c
+    /// in_start, wrapping around at @c in_size.
+    unsigned char * in;
+    size_t in_size;
+    size_t in_start;
+    size_t in_len;
+
+    /// Lines that wrap around the end of @c in are copied here.
+    char * line_buf;
+    size_t line_buf_size;
+
+    unsigned char * out;                ///< Output buffer.
+    size_t out_size;
     unsigned char * out_next;           ///< Next byte to place output in.
 
-    unsigned char in[4096];             ///< Input buffer.
-    unsigned char out[4096];            ///< Output buffer.
-    unsigned char zin[4096];            ///< (Compressed) input buffer.
+    /// When compressing, requests are formatted here, and compressed in bulk.
+    /// The same size as @c out.
+    unsigned char * plain;
+    size_t plain_len;
+
+    unsigned char * zin;                ///< (Compressed) input buffer.
+    size_t zin_size;
+
+    /// The directories that the server has been given this session, as
+    /// cached strings relative to the module.
+    string_hash_t directories;
 } cvs_connection_t;
 
 
+/// The size of the buffers for new connections.  The input buffer grows if
+/// needed for long lines.
+extern size_t cvs_buffer_size;
+
+/// A library to LD_PRELOAD into cvs server processes that we run locally, or
+/// NULL.
+extern const char * cvs_preload;
+
 /// Create a connection to the CVS server for @c root.
 void connect_to_cvs (cvs_connection_t * conn, const char * root);
 
+/// If @c root names a repository on this machine, return (malloc'd) its
+/// absolute path, otherwise NULL.
+const char * cvs_local_root (const char * root);
+
 /// Negotiate compression at the given level.
 void cvs_connection_compress (cvs_connection_t * conn, int level);
 
+/// Choose whether to compress, and at which level, from the measured speed of
+/// the connection; see @ref cvs_connection_adapt.  Connections to a local
+/// server are never compressed.
+void cvs_connection_compress_auto (cvs_connection_t * conn);
+
+/// With @ref cvs_connection_compress_auto, once enough data has been read to
+/// judge the link speed, turn on compression if it pays.  Compression cannot
+/// be turned off once on, so this is decided once.  Must only be called when
+/// no replies are outstanding.
+void cvs_connection_adapt (cvs_connection_t * conn);
+
 /// Destroy a connection object.
 void cvs_connection_destroy (cvs_connection_t * conn);
 
+/// Is there input from the server that can be read without waiting on the
+/// socket?  May give false positives with compression.
+bool cvs_input_pending (const cvs_connection_t * s);
+
 /// Call getline and do some sanity checking.
 size_t next_line (cvs_connection_t * s);
 
@@ -61,6 +123,18 @@ size_t next_line (cvs_connection_t * s);
 /// data is read and discarded.
 void cvs_read_block (cvs_connection_t * s, FILE * f, size_t n);
 
+/// As @ref cvs_read_block, also adding the data to @c hash.
+void cvs_read_block_sha1 (cvs_connection_t * s, FILE * f, size_t n,
+                          sha1_t * hash);
+
+/// Send the Directory request for @c dir (@c len bytes, relative to the module),
+/// unless the server has already had it this session and @c force is false.
+/// Returns true if it was sent.  The server keeps directories for the whole
+/// session, but requests that apply to the current directory, such as Entry,
+/// need the Directory sent immediately before them.
+bool cvs_directory (cvs_connection_t * s, const char * dir, size_t len,
+                    bool force);
+
 /// Send some data to the cvs connection.
 void cvs_printf (cvs_connection_t * s, const char * format, ...)
     __attribute__ ((format (printf, 2, 3)));
@@ -0,0 +1,197 @@
+#include "keywords.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+typedef enum keyword {
+    kw_author,
+    kw_cvsheader,
+    kw_date,
+    kw_header,
+    kw_id,
+    kw_locker,
+    kw_log,
+    kw_name,
+    kw_rcsfile,
+    kw_revision,
+    kw_source,
+    kw_state,
+    kw_none,
+} keyword_t;
+
+static const char * const keyword_names[] = {
+    "Author", "CVSHeader", "Date", "Header", "Id", "Locker", "Log", "Name",
+    "RCSfile", "Revision", "Source", "State"
+};
+
+
+bool keywords_active (const char * mode)
+{
+    return strcmp (mode, "o") != 0 && strcmp (mode, "b") != 0;
+}
+
+
+static keyword_t find_keyword (const char * name, size_t len)
+{
+    for (keyword_t k = 0; k != kw_none; ++k)
+        if (strlen (keyword_names[k]) == len
+            && memcmp (keyword_names[k], name, len) == 0)
+            return k;
+    return kw_none;
+}
+
+
+static inline bool is_alpha (int c)
+{
+    return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z');
+}
+
+
+static const char * base_name (const char * path)
+{
+    const char * slash = strrchr (path, '/');
+    return slash ? slash + 1 : path;
+}
+
+
+/// Write the value for keyword @c k.
+static void print_value (FILE * out, keyword_t k, bool locker,
+                         const keyword_info_t * info, const char * date)
+{
+    switch (k) {
+    case kw_author:
+        fputs (info->author, out);
+        break;
+    case kw_date:
+        fputs (date, out);
+        break;
+    case kw_cvsheader:
+    case kw_header:
+    case kw_id:
+        fprintf (out, "%s %s %s %s %s",
+                 k == kw_id ? base_name (info->rcs_path)
+                 : k == kw_header ? info->rcs_path : info->cvs_path,
+                 info->version, date, info->author, info->state);
+        if (locker && info->locker)
+            fprintf (out, " %s", info->locker);
+        break;
+    case kw_locker:
+        if (locker && info->locker)
+            fputs (info->locker, out);
+        break;
+    case kw_log:
+    case kw_rcsfile:
+        fputs (base_name (info->rcs_path), out);
+        break;
+    case kw_name:
+        break;
+    case kw_revision:
+        fputs (info->version, out);
+        break;
+    case kw_source:
+        fputs (info->rcs_path, out);
+        break;
+    case kw_state:
+        fputs (info->state, out);
+        break;
+    default:
+        abort();
+    }
+}
+
+
+/// Write the log message inserted after a $Log$ line, each line prefixed with
+/// @c leader.
+static void print_log (FILE * out, const keyword_info_t * info,
+                       const char * date, const char * leader, size_t len)
+{
+    // Empty lines get the leader without trailing white-space.
+    size_t trimmed = len;
+    while (trimmed > 0
+           && (leader[trimmed - 1] == ' ' || leader[trimmed - 1] == '\t'))
+        --trimmed;
+
+    fprintf (out, "%.*sRevision %s  %s  %s\n", (int) len, leader,
+             info->version, date, info->author);
+
+    const char * p = info->log;
+    const char * end = info->log + info->log_len;
+    while (p != end) {
+        const char * nl = memchr (p, '\n', end - p);
+        const char * e = nl ? nl : end;
+        if (e == p)
+            fprintf (out, "%.*s\n", (int) trimmed, leader);
+        else
+            fprintf (out, "%.*s%.*s\n", (int) len, leader, (int) (e - p), p);
+        p = nl ? nl + 1 : end;
+    }
+}
+
+
+void keywords_expand_line (FILE * out, const char * mode,
+                           const keyword_info_t * info,
+                           const char * line, size_t len)
+{
+    if (!keywords_active (mode)) {
+        fwrite (line, len, 1, out);
+        return;
+    }
+
+    bool value_only = strcmp (mode, "v") == 0;
+    bool name_only = strcmp (mode, "k") == 0;
+    // The CVS spelling is "kvl"; we have always accepted "kv1" too.
+    bool locker = strcmp (mode, "kvl") == 0 || strcmp (mode, "kv1") == 0;
+
+    struct tm tm;
+    char date[32];
+    gmtime_r (&info->time, &tm);
+    strftime (date, sizeof date, "%Y/%m/%d %H:%M:%S", &tm);
+
+    const char * end = line + len;
+    const char * done = line;
+    const char * p = line;
+    const char * log_leader = NULL;
+    while ((p = memchr (p, '$', end - p)) != NULL) {
+        const char * name = p + 1;
+        const char * name_end = name;
+        while (name_end != end && is_alpha (*name_end))
+            ++name_end;
+
+        keyword_t k = find_keyword (name, name_end - name);
+        const char * close = NULL;
+        if (k != kw_none && name_end != end) {
+            if (*name_end == '$')
+                close = name_end;
+            else if (*name_end == ':')
+                close = memchr (name_end, '$', end - name_end);
+        }
+        if (close == NULL) {
+            p = name;
+            continue;
+        }
+
+        fwrite (done, p - done, 1, out);
+        if (name_only)
+            fprintf (out, "$%s$", keyword_names[k]);
+        else {
+            if (!value_only)
+                fprintf (out, "$%s: ", keyword_names[k]);
+            print_value (out, k, locker, info, date);
+            if (!value_only)
+                fputs (" $", out);
+        }
+
+        if (k == kw_log && !name_only)
+            log_leader = p;
+
+        p = done = close + 1;
+    }
+
+    fwrite (done, end - done, 1, out);
+
+    if (log_leader != NULL) {
+        if (len == 0 || end[-1] != '\n')
+            fputc ('\n', out);
+        print_log (out, info, date, line, log_leader - line);
+    }
+}
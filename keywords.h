@@ -0,0 +1,34 @@
+#ifndef KEYWORDS_H
+#define KEYWORDS_H
+
+/// @file
+/// Client side CVS keyword expansion.
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <time.h>
+
+/// The revision information that keywords expand to.
+typedef struct keyword_info {
+    const char * rcs_path;              ///< Full path of the ,v file.
+    const char * cvs_path;              ///< Path of the ,v file in the root.
+    const char * version;
+    const char * author;
+    const char * state;
+    const char * locker;                ///< May be NULL.
+    const char * log;
+    size_t log_len;
+    time_t time;
+} keyword_info_t;
+
+/// Does the keyword substitution @c mode ever change the file content?
+bool keywords_active (const char * mode);
+
+/// Write the @c len bytes at @c line to @c out, expanding keywords according to
+/// @c mode.  The line should contain at most one newline, at the end.
+void keywords_expand_line (FILE * out, const char * mode,
+                           const keyword_info_t * info,
+                           const char * line, size_t len);
+
+#endif
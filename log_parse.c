@@ -3,15 +3,21 @@
 #include "file.h"
 #include "log.h"
 #include "log_parse.h"
+#include "rcs.h"
+#include "snapshot.h"
 #include "string_cache.h"
 #include "utils.h"
 
 #include <assert.h>
+#include <dirent.h>
+#include <pthread.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/stat.h>
 #include <time.h>
+#include <unistd.h>
 
 
 #define REV_BOUNDARY "M ----------------------------"
@@ -30,6 +36,62 @@ typedef struct file_tag {
 } file_tag_t;
 
 
+/// A file as read, before its versions and tags are filled in.
+typedef struct raw_file {
+    size_t index;                       ///< In the database file list.
+    bool attic;
+    const char * stamp;                 ///< From the rlog header, if any.
+    file_tag_t * tags;
+    file_tag_t * tags_end;
+} raw_file_t;
+
+
+/// The header of a file's rlog.
+typedef struct rlog_header {
+    const char * rcs_path;
+    const char * path;
+    bool attic;
+    const char * stamp;                 ///< Head, branch and revision count.
+    file_tag_t * tags;
+    file_tag_t * tags_end;
+} rlog_header_t;
+
+
+/// A file listed before the rlog proper, for an incremental rlog; either by a
+/// walk of a local repository or by a header-only rlog.
+typedef struct listed_file {
+    const char * rcs_path;              ///< Cached.
+    const char * path;
+    bool attic;
+    const char * stamp;
+    const snapshot_record_t * record;   ///< If unchanged since the snapshot.
+    /// From the header-only rlog; these replace the tags in the snapshot.  NULL
+    /// for a walk.
+    file_tag_t * tags;
+    file_tag_t * tags_end;
+} listed_file_t;
+
+
+/// A piece of the module, read independently of the others, possibly in
+/// another thread.
+typedef struct shard {
+    const char * path;                  ///< Within the module, or NULL.
+    bool top_only;             ///< If path is NULL, no sub-directories?
+    database_t db;
+    string_hash_t tags;
+
+    const snapshot_t * snapshot;        ///< The previous run's records.
+    FILE * records;                     ///< This run's records, or NULL.
+    char * records_data;
+    size_t records_len;
+
+    raw_file_t * raws;                  ///< Files read but not filled in.
+    raw_file_t * raws_end;
+    listed_file_t * listed;             ///< Files to fetch or reuse.
+    listed_file_t * listed_end;
+} shard_t;
+
+
 // Unlike isdigit, only ever ASCII.
 static inline bool is_digit (int x)
 {
@@ -604,19 +666,12 @@ static void read_m_key_values (file_t * file, version_t * version,
 }
 
 
-static void read_file_version (file_t * file, cvs_connection_t * s)
+/// Create a new version of @c file, with version string @c vstr.
+static version_t * new_version (file_t * file, const char * vstr, size_t len)
 {
-    if (!starts_with (s->line, "M revision "))
-        fatal ("Log (%s) did not have expected 'revision' line: %s\n",
-               file->rcs_path, s->line);
-
     version_t * version = file_new_version (file);
 
-    const char * vstr = s->line + 11;
-    char * tab = strchr (vstr, '\t');
-
-    version->version = cache_string_n (
-        vstr, tab ? (size_t) (tab - vstr) : strlen (vstr));
+    version->version = cache_string_n (vstr, len);
     if (!valid_version (version->version))
         fatal ("Log (%s) has malformed version %s\n",
                file->rcs_path, version->version);
@@ -626,6 +681,37 @@ static void read_file_version (file_t * file, cvs_connection_t * s)
     version->dead = false;
     version->children = NULL;
     version->sibling = NULL;
+    return version;
+}
+
+
+/// If @c file's last version looks like a vendor import, create an implicit
+/// merge item for it.
+static void add_implicit_merge (file_t * file)
+{
+    version_t * version = &file->versions_end[-1];
+    // FIXME - improve this test.
+    if (strncmp (version->version, "1.1.1.", 6) == 0
+        && strchr (version->version + 6, '.') == NULL) {
+        // Looks like like a vendor import; create an implicit merge item.
+        ARRAY_EXTEND (file->versions);
+        file->versions_end[-1] = file->versions_end[-2];
+        file->versions_end[-1].implicit_merge = true;
+    }
+}
+
+
+static void read_file_version (file_t * file, cvs_connection_t * s)
+{
+    if (!starts_with (s->line, "M revision "))
+        fatal ("Log (%s) did not have expected 'revision' line: %s\n",
+               file->rcs_path, s->line);
+
+    const char * vstr = s->line + 11;
+    char * tab = strchr (vstr, '\t');
+
+    version_t * version = new_version (
+        file, vstr, tab ? (size_t) (tab - vstr) : strlen (vstr));
 
     size_t len = next_line (s);
     if (starts_with (s->line, "MT "))
@@ -659,20 +745,13 @@ static void read_file_version (file_t * file, cvs_connection_t * s)
     version->log = cache_string_n (log, log_len);
     free (log);
 
-    // FIXME - improve this test.
-    if (strncmp (version->version, "1.1.1.", 6) == 0
-        && strchr (version->version + 6, '.') == NULL) {
-        // Looks like like a vendor import; create an implicit merge item.
-        ARRAY_EXTEND (file->versions);
-        file->versions_end[-1] = file->versions_end[-2];
-        file->versions_end[-1].implicit_merge = true;
-    }
+    add_implicit_merge (file);
 }
 
 
-static void read_file_versions (database_t * db,
-                                string_hash_t * tags,
-                                cvs_connection_t * s)
+/// Read the header of a file's rlog, up to but not including the description.
+static void read_file_header (string_hash_t * tags, cvs_connection_t * s,
+                              rlog_header_t * h)
 {
     if (!starts_with (s->line, "M RCS file: /"))
         fatal ("Expected RCS file line, not %s\n", s->line);
@@ -681,8 +760,7 @@ static void read_file_versions (database_t * db,
     if ((s->line)[len - 1] != 'v' || (s->line)[len - 2] != ',')
         fatal ("RCS file name does not end with ',v': %s\n", s->line);
 
-    file_t * file = database_new_file (db);
-    file->rcs_path = cache_string_n (s->line + 12, len - 12);
+    h->rcs_path = cache_string_n (s->line + 12, len - 12);
 
     if (!starts_with (s->line + 12, s->prefix))
         fatal ("RCS file name '%s' does not start with prefix '%s'\n",
@@ -690,28 +768,39 @@ static void read_file_versions (database_t * db,
 
     (s->line)[len - 2] = 0;                 // Remove the ',v'
     char * last_slash = strrchr (s->line, '/');
-    bool attic = false;
+    h->attic = false;
     if (last_slash != NULL && last_slash - s->line >= 18 &&
         memcmp (last_slash - 6, "/Attic", 6) == 0) {
         // Remove that Attic portion.  We can't use strcpy because the strings
         // may overlap.
-        attic = true;
+        h->attic = true;
         memmove (last_slash - 6, last_slash, strlen (last_slash) + 1);
     }
 
-    file->path = cache_string (s->line + 12 + strlen (s->prefix));
+    h->path = cache_string (s->line + 12 + strlen (s->prefix));
 
-    file_tag_t * file_tags = NULL;
-    file_tag_t * file_tags_end = NULL;
+    h->tags = NULL;
+    h->tags_end = NULL;
 
     // Add a fake branch for the trunk.
     const char * empty_string = cache_string ("");
-    ARRAY_EXTEND (file_tags);
-    file_tags_end[-1].tag = get_tag (tags, empty_string);
-    file_tags_end[-1].version = empty_string;
+    ARRAY_EXTEND (h->tags);
+    h->tags_end[-1].tag = get_tag (tags, empty_string);
+    h->tags_end[-1].version = empty_string;
 
-    do
+    // The head, default branch and revision count change whenever a revision
+    // is added or removed; they make the stamp.
+    const char * head = empty_string;
+    const char * branch = empty_string;
+    unsigned long total = 0;
+
+    do {
         len = next_line (s);
+        if (starts_with (s->line, "M head:"))
+            head = cache_string (s->line + 7);
+        else if (starts_with (s->line, "M branch:"))
+            branch = cache_string (s->line + 9);
+    }
     while (starts_with (s->line, "M head:") ||
            starts_with (s->line, "M branch:") ||
            starts_with (s->line, "M locks:") ||
@@ -720,7 +809,7 @@ static void read_file_versions (database_t * db,
 
     if (!starts_with (s->line, "M symbolic names:"))
         fatal ("Log (%s) did not have expected tag list: %s\n",
-               file->rcs_path, s->line);
+               h->rcs_path, s->line);
 
     len = next_line (s);
 
@@ -728,7 +817,7 @@ static void read_file_versions (database_t * db,
         char * colon = strrchr (s->line, ':');
         if (colon == NULL)
             fatal ("Tag on (%s) did not have version: %s\n",
-                   file->rcs_path, s->line);
+                   h->rcs_path, s->line);
 
         const char * tag_name = cache_string_n (s->line + 3,
                                                 colon - s->line - 3);
@@ -738,18 +827,38 @@ static void read_file_versions (database_t * db,
 
         if (!normalise_tag_version (colon))
             fatal ("Tag %s on (%s) has bogus version '%s'\n",
-                   tag_name, file->rcs_path, colon);
+                   tag_name, h->rcs_path, colon);
 
-        ARRAY_EXTEND (file_tags);
-        file_tags_end[-1].tag = get_tag (tags, tag_name);
-        file_tags_end[-1].version = cache_string (colon);
+        ARRAY_EXTEND (h->tags);
+        h->tags_end[-1].tag = get_tag (tags, tag_name);
+        h->tags_end[-1].version = cache_string (colon);
 
         len = next_line (s);
     }
 
     while (starts_with (s->line, "M keyword substitution:") ||
-           starts_with (s->line, "M total revisions:"))
+           starts_with (s->line, "M total revisions:")) {
+        if (starts_with (s->line, "M total revisions:"))
+            total = strtoul (s->line + 18, NULL, 10);
         len = next_line (s);
+    }
+
+    h->stamp = cache_stringf ("%s %s %lu", head, branch, total);
+}
+
+
+/// Read the rlog output for one file into @c raw.
+static void read_file_versions (database_t * db,
+                                string_hash_t * tags,
+                                cvs_connection_t * s,
+                                raw_file_t * raw)
+{
+    rlog_header_t h;
+    read_file_header (tags, s, &h);
+
+    file_t * file = database_new_file (db);
+    file->rcs_path = h.rcs_path;
+    file->path = h.path;
 
     if (!starts_with (s->line, "M description:"))
         fatal ("Log (%s) did not have expected 'description' item: %s\n",
@@ -762,19 +871,157 @@ static void read_file_versions (database_t * db,
         if (!starts_with (s->line, "M "))
             fatal ("Log (%s) description incorrectly terminated\n",
                    file->rcs_path);
-        len = next_line (s);
+        next_line (s);
     }
 
     while (strcmp (s->line, FILE_BOUNDARY) != 0) {
-        len = next_line (s);
+        next_line (s);
         read_file_version (file, s);
     }
 
     next_line (s);
 
-    fill_in_versions_and_parents (file, attic, file_tags, file_tags_end, tags);
+    raw->index = file - db->files;
+    raw->attic = h.attic;
+    raw->stamp = h.stamp;
+    raw->tags = h.tags;
+    raw->tags_end = h.tags_end;
+}
+
+
+/// Fill in the versions and tags of the file read into @c raw.
+static void finish_file (database_t * db, string_hash_t * tags,
+                         raw_file_t * raw)
+{
+    fill_in_versions_and_parents (&db->files[raw->index], raw->attic,
+                                  raw->tags, raw->tags_end, tags);
+    xfree (raw->tags);
+}
+
+
+/// Write the snapshot record, with @c stamp, for the file read into @c raw.
+static void record_file (FILE * out, const database_t * db,
+                         const raw_file_t * raw, const char * stamp)
+{
+    const file_t * file = &db->files[raw->index];
+    char * data = NULL;
+    size_t len = 0;
+    FILE * f = open_memstream (&data, &len);
+    if (f == NULL)
+        fatal ("open_memstream failed: %m\n");
+
+    snapshot_put_int (f, raw->tags_end - raw->tags);
+    for (const file_tag_t * i = raw->tags; i != raw->tags_end; ++i) {
+        snapshot_put_string (f, i->tag->tag, strlen (i->tag->tag));
+        snapshot_put_string (f, i->version, strlen (i->version));
+    }
+
+    // Implicit merges are recreated on loading.
+    size_t count = 0;
+    for (const version_t * i = file->versions; i != file->versions_end; ++i)
+        count += !i->implicit_merge;
+    snapshot_put_int (f, count);
+    for (const version_t * i = file->versions; i != file->versions_end; ++i) {
+        if (i->implicit_merge)
+            continue;
+        snapshot_put_string (f, i->version, strlen (i->version));
+        snapshot_put_string (f, i->author, strlen (i->author));
+        snapshot_put_string (f, i->commitid, strlen (i->commitid));
+        snapshot_put_string (f, i->log, strlen (i->log));
+        snapshot_put_int (f, i->time);
+        snapshot_put_int (f, i->offset);
+        snapshot_put_int (f, i->dead);
+    }
+
+    fclose (f);
+    snapshot_put_record (out, file->rcs_path, stamp, data, len);
+    free (data);
+}
+
 
-    xfree (file_tags);
+/// Check that a snapshot record payload is complete, as @ref load_file reads
+/// it.
+static bool check_record (snapshot_cursor_t * c)
+{
+    int64_t n;
+    if (!snapshot_try_int (c, &n))
+        return false;
+    for (; n > 0; --n)
+        if (!snapshot_try_string (c) || !snapshot_try_string (c))
+            return false;
+
+    if (!snapshot_try_int (c, &n))
+        return false;
+    for (; n > 0; --n) {
+        int64_t v;
+        for (int i = 0; i != 4; ++i)
+            if (!snapshot_try_string (c))
+                return false;
+        for (int i = 0; i != 3; ++i)
+            if (!snapshot_try_int (c, &v))
+                return false;
+    }
+
+    return c->p == c->end;
+}
+
+
+static const char * get_cached (snapshot_cursor_t * c)
+{
+    size_t len;
+    const char * s = snapshot_get_string (c, &len);
+    return cache_string_n (s, len);
+}
+
+
+/// Recreate a file from its snapshot record @c rec, as @ref read_file_versions
+/// would have read it.  If @c file_tags is not NULL, the tags
+/// [@c file_tags, @c file_tags_end) are used instead of those in the record.
+static void load_file (database_t * db, string_hash_t * tags,
+                       const snapshot_record_t * rec,
+                       const char * path, bool attic,
+                       file_tag_t * file_tags, file_tag_t * file_tags_end,
+                       raw_file_t * raw)
+{
+    file_t * file = database_new_file (db);
+    file->rcs_path = rec->head.string;
+    file->path = cache_string (path);
+
+    raw->index = file - db->files;
+    raw->attic = attic;
+    raw->stamp = NULL;
+    raw->tags = file_tags;
+    raw->tags_end = file_tags_end;
+
+    snapshot_cursor_t c = { rec->data, rec->data_end, file->rcs_path };
+    for (int64_t n = snapshot_get_int (&c); n > 0; --n) {
+        if (file_tags != NULL) {
+            // Don't create the tags, they may be gone.
+            size_t len;
+            snapshot_get_string (&c, &len);
+            snapshot_get_string (&c, &len);
+            continue;
+        }
+        ARRAY_EXTEND (raw->tags);
+        raw->tags_end[-1].tag = get_tag (tags, get_cached (&c));
+        raw->tags_end[-1].version = get_cached (&c);
+    }
+
+    for (int64_t n = snapshot_get_int (&c); n > 0; --n) {
+        size_t len;
+        const char * vstr = snapshot_get_string (&c, &len);
+        version_t * version = new_version (file, vstr, len);
+        version->author = get_cached (&c);
+        version->commitid = get_cached (&c);
+        version->log = get_cached (&c);
+        version->time = snapshot_get_int (&c);
+        version->offset = snapshot_get_int (&c);
+        version->dead = snapshot_get_int (&c) != 0;
+        add_implicit_merge (file);
+    }
+
+    if (c.p != c.end)
+        fatal ("Snapshot record for %s has trailing junk\n", file->rcs_path);
 }
 
 
@@ -836,21 +1083,9 @@ static void trim_dead_branch_additions (tag_t * branch)
 }
 
 
-void read_files_versions (database_t * db, cvs_connection_t * s)
+/// Once all the files are read, sort everything and fill in the tags.
+static void finish_database (database_t * db, string_hash_t * tags)
 {
-    database_init (db);
-
-    string_hash_t tags;
-    string_hash_init (&tags);
-
-    next_line (s);
-
-    while (strcmp (s->line, "ok") != 0)
-        if (strcmp (s->line, "M ") == 0)
-            next_line (s);
-        else
-            read_file_versions (db, &tags, s);
-
     // Sort the list of files.
     ARRAY_SORT (db->files, compare_file);
 
@@ -860,19 +1095,19 @@ void read_files_versions (database_t * db, cvs_connection_t * s)
             j->file = f;
 
     // Flatten the hash of tags to an array.
-    db->tags = ARRAY_ALLOC (tag_t, tags.num_entries);
+    db->tags = ARRAY_ALLOC (tag_t, tags->num_entries);
     db->tags_end = db->tags;
 
-    for (tag_hash_item_t * i = string_hash_begin (&tags);
-         i; i = string_hash_next (&tags, i))
+    for (tag_hash_item_t * i = string_hash_begin (tags);
+         i; i = string_hash_next (tags, i))
         *db->tags_end++ = i->tag;
 
-    assert (db->tags_end == db->tags + tags.num_entries);
+    assert (db->tags_end == db->tags + tags->num_entries);
 
     // Sort the list of tags.
     ARRAY_SORT (db->tags, compare_tag);
     for (tag_t * i = db->tags; i != db->tags_end; ++i) {
-        tag_hash_item_t * h = string_hash_find (&tags, i->tag);
+        tag_hash_item_t * h = string_hash_find (tags, i->tag);
         assert (h);
         assert (h->tag.tag == i->tag);
         h->tag.parent = &i->changeset;
@@ -903,5 +1138,771 @@ void read_files_versions (database_t * db, cvs_connection_t * s)
         i->is_released = false;
     }
 
-    string_hash_destroy (&tags);
+    string_hash_destroy (tags);
+}
+
+
+/// Read the rlog output from @c s into @c shard.  If @c keep_raw, the files are
+/// left on the shard's raw list, else they are filled in as they are read.
+static void read_rlog (shard_t * shard, cvs_connection_t * s, bool keep_raw)
+{
+    next_line (s);
+
+    while (strcmp (s->line, "ok") != 0) {
+        if (strcmp (s->line, "M ") == 0) {
+            next_line (s);
+            continue;
+        }
+
+        raw_file_t raw;
+        read_file_versions (&shard->db, &shard->tags, s, &raw);
+        if (keep_raw)
+            ARRAY_APPEND (shard->raws, raw);
+        else {
+            if (shard->records != NULL)
+                record_file (shard->records, &shard->db, &raw, raw.stamp);
+            finish_file (&shard->db, &shard->tags, &raw);
+        }
+    }
+}
+
+
+/// Fill in @c version from the RCS delta @c d, as the rlog would.
+static void read_rcs_delta (file_t * file, version_t * version,
+                            const rcs_delta_t * d)
+{
+    if (!rcs_parse_date (&version->time, d->date))
+        fatal ("Log (%s) date has unknown format: %.*s\n",
+               file->rcs_path, (int) d->date.len, d->date.data);
+    version->offset = 0;
+
+    version->author = cache_string_n (d->author.data, d->author.len);
+    if (d->commitid.len != 0)
+        version->commitid = cache_string_n (d->commitid.data, d->commitid.len);
+    version->dead = d->state.len == 4 && memcmp (d->state.data, "dead", 4) == 0;
+
+    // Like rlog, replace an empty log, and make sure the log ends with a
+    // newline.
+    size_t len;
+    char * log = rcs_text_copy (d->log, &len);
+    if (len == 0)
+        version->log = cache_string ("*** empty log message ***\n");
+    else if (log[len - 1] != '\n')
+        version->log = cache_stringf ("%s\n", log);
+    else
+        version->log = cache_string_n (log, len);
+    xfree (log);
+}
+
+
+/// Read the ,v file @c rcs_path into @c raw.  @c path is the file path within
+/// the module.
+static void read_rcs_file (database_t * db, string_hash_t * tags,
+                           const char * rcs_path, const char * path,
+                           bool attic, raw_file_t * raw)
+{
+    rcs_file_t rcs;
+    rcs_open (&rcs, rcs_path);
+
+    file_t * file = database_new_file (db);
+    file->rcs_path = cache_string (rcs_path);
+    file->path = cache_string (path);
+
+    file_tag_t * file_tags = NULL;
+    file_tag_t * file_tags_end = NULL;
+
+    // Add a fake branch for the trunk.
+    const char * empty_string = cache_string ("");
+    ARRAY_EXTEND (file_tags);
+    file_tags_end[-1].tag = get_tag (tags, empty_string);
+    file_tags_end[-1].version = empty_string;
+
+    for (rcs_symbol_t * i = rcs.symbols; i != rcs.symbols_end; ++i) {
+        const char * tag_name = cache_string_n (i->name.data, i->name.len);
+        char vers[i->num.len + 1];
+        memcpy (vers, i->num.data, i->num.len);
+        vers[i->num.len] = 0;
+        if (!normalise_tag_version (vers))
+            fatal ("Tag %s on (%s) has bogus version '%s'\n",
+                   tag_name, file->rcs_path, vers);
+
+        ARRAY_EXTEND (file_tags);
+        file_tags_end[-1].tag = get_tag (tags, tag_name);
+        file_tags_end[-1].version = cache_string (vers);
+    }
+
+    for (rcs_delta_t * d = rcs.deltas; d != rcs.deltas_end; ++d) {
+        version_t * version = new_version (file, d->num.data, d->num.len);
+        read_rcs_delta (file, version, d);
+        add_implicit_merge (file);
+    }
+
+    rcs_close (&rcs);
+
+    raw->index = file - db->files;
+    raw->attic = attic;
+    raw->stamp = NULL;
+    raw->tags = file_tags;
+    raw->tags_end = file_tags_end;
+}
+
+
+static bool is_directory (const char * path)
+{
+    struct stat st;
+    return stat (path, &st) == 0 && S_ISDIR (st.st_mode);
+}
+
+
+/// A directory entry, for @ref read_rcs_directory.
+typedef struct rcs_entry {
+    const char * name;                  ///< Without any ',v'.
+    bool attic;
+} rcs_entry_t;
+
+
+/// The contents of a directory and its Attic.
+typedef struct rcs_listing {
+    rcs_entry_t * files;
+    rcs_entry_t * files_end;
+    rcs_entry_t * dirs;
+    rcs_entry_t * dirs_end;
+} rcs_listing_t;
+
+
+static int compare_rcs_entry (const void * AA, const void * BB)
+{
+    const rcs_entry_t * A = AA;
+    const rcs_entry_t * B = BB;
+    int r = strcmp (A->name, B->name);
+    // Live files before Attic ones, so that the latter are easily shadowed.
+    return r ? r : A->attic - B->attic;
+}
+
+
+/// Add the contents of the directory @c path to @c l.
+static void list_rcs_directory (rcs_listing_t * l, const char * path,
+                                bool attic)
+{
+    DIR * d = opendir (path);
+    if (d == NULL) {
+        if (attic)
+            return;                     // No Attic is fine.
+        fatal ("Opening directory %s failed: %m\n", path);
+    }
+
+    struct dirent * e;
+    while ((e = readdir (d)) != NULL) {
+        if (strcmp (e->d_name, ".") == 0 || strcmp (e->d_name, "..") == 0)
+            continue;
+
+        bool is_dir = e->d_type == DT_DIR;
+        if (e->d_type == DT_UNKNOWN) {
+            const char * full = xasprintf ("%s%s", path, e->d_name);
+            is_dir = is_directory (full);
+            xfree (full);
+        }
+
+        size_t len = strlen (e->d_name);
+        rcs_entry_t entry = { .attic = attic };
+        if (!is_dir && len > 2 && ends_with (e->d_name, ",v")) {
+            entry.name = strndup (e->d_name, len - 2);
+            ARRAY_APPEND (l->files, entry);
+        }
+        else if (is_dir && !attic && strcmp (e->d_name, "Attic") != 0
+                 && strcmp (e->d_name, "CVS") != 0) {
+            entry.name = xstrdup (e->d_name);
+            ARRAY_APPEND (l->dirs, entry);
+        }
+    }
+
+    closedir (d);
+}
+
+
+/// Called for each ,v file found by a walk of the repository.
+typedef void rcs_visit_t (shard_t * shard, const char * rcs_path,
+                          const char * path, bool attic);
+
+
+/// Visit all the ,v files in the directory @c prefix / @c dir, including its
+/// Attic, and, if @c recurse, its sub-directories.  @c dir is empty or ends in
+/// a '/'.  We go in the same order as CVS: files sorted by name, then the
+/// sub-directories.
+static void walk_rcs_directory (shard_t * shard, rcs_visit_t * visit,
+                                const char * prefix, const char * dir,
+                                bool recurse)
+{
+    rcs_listing_t l = { NULL, NULL, NULL, NULL };
+    const char * dir_path = xasprintf ("%s%s", prefix, dir);
+    const char * attic_path = xasprintf ("%sAttic/", dir_path);
+    list_rcs_directory (&l, dir_path, false);
+    list_rcs_directory (&l, attic_path, true);
+
+    ARRAY_SORT (l.files, compare_rcs_entry);
+    for (rcs_entry_t * i = l.files; i != l.files_end; ++i) {
+        // Like CVS, ignore an Attic file that is shadowed by a live one.
+        if (i != l.files && strcmp (i[-1].name, i->name) == 0)
+            continue;
+
+        const char * rcs_path = xasprintf (
+            "%s%s,v", i->attic ? attic_path : dir_path, i->name);
+        const char * path = xasprintf ("%s%s", dir, i->name);
+        visit (shard, rcs_path, path, i->attic);
+        xfree (path);
+        xfree (rcs_path);
+    }
+
+    ARRAY_SORT (l.dirs, compare_rcs_entry);
+    for (rcs_entry_t * i = l.dirs; i != l.dirs_end; ++i)
+        if (recurse) {
+            const char * sub = xasprintf ("%s%s/", dir, i->name);
+            walk_rcs_directory (shard, visit, prefix, sub, true);
+            xfree (sub);
+        }
+
+    for (rcs_entry_t * i = l.files; i != l.files_end; ++i)
+        xfree (i->name);
+    for (rcs_entry_t * i = l.dirs; i != l.dirs_end; ++i)
+        xfree (i->name);
+    free (l.files);
+    free (l.dirs);
+    xfree (attic_path);
+    xfree (dir_path);
+}
+
+
+/// Visit the file or directory @c path within the module.
+static void walk_rcs_path (shard_t * shard, rcs_visit_t * visit,
+                           const char * prefix, const char * path)
+{
+    const char * full = xasprintf ("%s%s", prefix, path);
+    if (is_directory (full)) {
+        const char * dir = xasprintf ("%s/", path);
+        walk_rcs_directory (shard, visit, prefix, dir, true);
+        xfree (dir);
+        xfree (full);
+        return;
+    }
+
+    const char * rcs_path = xasprintf ("%s,v", full);
+    if (access (rcs_path, F_OK) == 0)
+        visit (shard, rcs_path, path, false);
+    else {
+        const char * slash = strrchr (path, '/');
+        int dir_len = slash ? slash - path + 1 : 0;
+        const char * attic_path = xasprintf (
+            "%s%.*sAttic/%s,v", prefix, dir_len, path, path + dir_len);
+        if (access (attic_path, F_OK) != 0)
+            fatal ("Nothing known about %s\n", full);
+        visit (shard, attic_path, path, true);
+        xfree (attic_path);
+    }
+
+    xfree (rcs_path);
+    xfree (full);
+}
+
+
+/// Walk the files of @c shard.
+static void walk_shard (shard_t * shard, rcs_visit_t * visit,
+                        const char * prefix)
+{
+    if (shard->path != NULL)
+        walk_rcs_path (shard, visit, prefix, shard->path);
+    else
+        walk_rcs_directory (shard, visit, prefix, "", !shard->top_only);
+}
+
+
+/// The stamp of a local ,v file: its size and modification time.
+static const char * stat_stamp (const char * rcs_path)
+{
+    struct stat st;
+    if (stat (rcs_path, &st) != 0)
+        fatal ("stat %s failed: %m\n", rcs_path);
+    return xasprintf ("%lld %lld.%09ld", (long long) st.st_size,
+                      (long long) st.st_mtim.tv_sec, st.st_mtim.tv_nsec);
+}
+
+
+/// Visitor that reads a ,v file, or, if it is unchanged, takes it from the
+/// snapshot.
+static void visit_rcs_file (shard_t * shard, const char * rcs_path,
+                            const char * path, bool attic)
+{
+    raw_file_t raw;
+    if (shard->records == NULL) {
+        read_rcs_file (&shard->db, &shard->tags, rcs_path, path, attic, &raw);
+        finish_file (&shard->db, &shard->tags, &raw);
+        return;
+    }
+
+    const char * stamp = stat_stamp (rcs_path);
+    const snapshot_record_t * rec = snapshot_find (
+        shard->snapshot, rcs_path, stamp);
+    if (rec != NULL) {
+        load_file (&shard->db, &shard->tags, rec, path, attic,
+                   NULL, NULL, &raw);
+        snapshot_copy_record (shard->records, rec);
+    }
+    else {
+        read_rcs_file (&shard->db, &shard->tags, rcs_path, path, attic, &raw);
+        record_file (shard->records, &shard->db, &raw, stamp);
+    }
+    finish_file (&shard->db, &shard->tags, &raw);
+    xfree (stamp);
+}
+
+
+/// Visitor that just lists the ,v files, for @ref read_rlog_changed.
+static void visit_local_file (shard_t * shard, const char * rcs_path,
+                              const char * path, bool attic)
+{
+    ARRAY_EXTEND (shard->listed);
+    listed_file_t * l = &shard->listed_end[-1];
+    l->rcs_path = cache_string (rcs_path);
+    l->path = cache_string (path);
+    l->attic = attic;
+    l->stamp = stat_stamp (rcs_path);
+    l->record = snapshot_find (shard->snapshot, rcs_path, l->stamp);
+    l->tags = NULL;
+    l->tags_end = NULL;
+}
+
+
+static int compare_shard (const void * AA, const void * BB)
+{
+    const shard_t * A = AA;
+    const shard_t * B = BB;
+    return strcmp (A->path, B->path);
+}
+
+
+/// Read @c shard, using @c context.
+typedef void shard_reader_t (shard_t * shard, void * context);
+
+
+/// The shards waiting for a thread to read them.
+typedef struct shard_queue {
+    pthread_mutex_t lock;
+    shard_t * next;
+    shard_t * end;
+    shard_reader_t * reader;
+} shard_queue_t;
+
+
+typedef struct shard_thread {
+    pthread_t thread;
+    shard_queue_t * queue;
+    void * context;
+} shard_thread_t;
+
+
+static void * shard_thread (void * p)
+{
+    shard_thread_t * t = p;
+    while (true) {
+        pthread_mutex_lock (&t->queue->lock);
+        shard_t * shard = t->queue->next;
+        if (shard != t->queue->end)
+            ++t->queue->next;
+        pthread_mutex_unlock (&t->queue->lock);
+
+        if (shard == t->queue->end)
+            return NULL;
+
+        t->queue->reader (shard, t->context);
+    }
+}
+
+
+/// Split the module at @c prefix into shards.  If @c paths is non-empty, that
+/// is one shard per path.  Otherwise, if @c split and we can list the module
+/// directory, there is one shard per top-level directory, plus one for the
+/// top-level files.  Else, one shard for everything.
+static shard_t * make_shards (const char * prefix, bool split,
+                              const char * const * paths,
+                              const char * const * paths_end,
+                              shard_t ** shards_end_p)
+{
+    shard_t * shards = NULL;
+    shard_t * shards_end = NULL;
+
+    if (paths != paths_end) {
+        for (const char * const * i = paths; i != paths_end; ++i) {
+            ARRAY_EXTEND (shards);
+            shards_end[-1].path = *i;
+            shards_end[-1].top_only = false;
+        }
+    }
+    else {
+        // If the module is not a plain directory (e.g., it is an alias in
+        // CVSROOT/modules), then don't split it.
+        DIR * d = split ? opendir (prefix) : NULL;
+
+        ARRAY_EXTEND (shards);
+        shards_end[-1].path = NULL;
+        shards_end[-1].top_only = d != NULL;
+
+        struct dirent * e;
+        while (d && (e = readdir (d)) != NULL) {
+            if (strcmp (e->d_name, ".") == 0 || strcmp (e->d_name, "..") == 0
+                || strcmp (e->d_name, "Attic") == 0
+                || strcmp (e->d_name, "CVS") == 0)
+                continue;
+
+            const char * path = xasprintf ("%s%s", prefix, e->d_name);
+            if (e->d_type == DT_DIR
+                || (e->d_type == DT_UNKNOWN && is_directory (path))) {
+                ARRAY_EXTEND (shards);
+                shards_end[-1].path = cache_string (e->d_name);
+                shards_end[-1].top_only = false;
+            }
+            xfree (path);
+        }
+
+        if (d)
+            closedir (d);
+
+        // CVS visits directories in name order; go in the same order, so that
+        // the merge of the shards below gives the same result as one rlog.
+        if (shards_end - shards > 2)
+            qsort (shards + 1, shards_end - shards - 1, sizeof (shard_t),
+                   compare_shard);
+    }
+
+    for (shard_t * i = shards; i != shards_end; ++i) {
+        database_init (&i->db);
+        string_hash_init (&i->tags);
+        i->snapshot = NULL;
+        i->records = NULL;
+        i->raws = NULL;
+        i->raws_end = NULL;
+        i->listed = NULL;
+        i->listed_end = NULL;
+    }
+
+    *shards_end_p = shards_end;
+    return shards;
+}
+
+
+/// Read the shards, using up to @c num_contexts threads, each with one of the
+/// @c contexts (which are @c context_size apart).  Then merge the shards into
+/// @c db, and free them.  If @c snapshot_path is not NULL, the readers may use
+/// the snapshot there (if it has the same @c snapshot_key), and it is
+/// rewritten afterwards.
+static void read_shards (database_t * db, shard_t * shards, shard_t * shards_end,
+                         shard_reader_t * reader,
+                         void * contexts, size_t context_size,
+                         size_t num_contexts,
+                         const char * snapshot_path, const char * snapshot_key)
+{
+    size_t num_shards = shards_end - shards;
+    size_t num_threads = num_contexts < num_shards ? num_contexts : num_shards;
+
+    snapshot_t snapshot;
+    if (snapshot_path != NULL) {
+        snapshot_open (&snapshot, snapshot_path, snapshot_key, check_record);
+        for (shard_t * i = shards; i != shards_end; ++i) {
+            i->snapshot = &snapshot;
+            i->records = open_memstream (&i->records_data, &i->records_len);
+            if (i->records == NULL)
+                fatal ("open_memstream failed: %m\n");
+        }
+    }
+
+    if (num_threads <= 1) {
+        for (shard_t * i = shards; i != shards_end; ++i)
+            reader (i, contexts);
+    }
+    else {
+        shard_queue_t queue = {
+            .lock = PTHREAD_MUTEX_INITIALIZER,
+            .next = shards, .end = shards_end, .reader = reader };
+        shard_thread_t threads[num_threads];
+        for (size_t i = 0; i != num_threads; ++i) {
+            threads[i].queue = &queue;
+            threads[i].context = (char *) contexts + i * context_size;
+            int r = pthread_create (&threads[i].thread, NULL,
+                                    shard_thread, &threads[i]);
+            if (r != 0)
+                fatal ("Creating thread failed: %s\n", strerror (r));
+        }
+        for (size_t i = 0; i != num_threads; ++i)
+            pthread_join (threads[i].thread, NULL);
+    }
+
+    if (snapshot_path != NULL) {
+        char * data[num_shards];
+        size_t lens[num_shards];
+        for (size_t i = 0; i != num_shards; ++i) {
+            fclose (shards[i].records);
+            data[i] = shards[i].records_data;
+            lens[i] = shards[i].records_len;
+        }
+        snapshot_write (snapshot_path, snapshot_key, data, lens, num_shards);
+        for (size_t i = 0; i != num_shards; ++i)
+            free (data[i]);
+        snapshot_close (&snapshot);
+    }
+
+    database_init (db);
+
+    string_hash_t tags;
+    string_hash_init (&tags);
+
+    // Merge the shards.  Tags are merged by name; everything else in the
+    // shards is disjoint.
+    for (shard_t * i = shards; i != shards_end; ++i) {
+        for (tag_hash_item_t * j = string_hash_begin (&i->tags);
+             j; j = string_hash_next (&i->tags, j)) {
+            tag_t * from = &j->tag;
+            tag_t * to = get_tag (&tags, from->tag);
+            if (from->branch_versions)
+                to->branch_versions = from->branch_versions;
+            if (from->dummy)
+                to->dummy = true;
+
+            // find_branch() only records branch points of a dummy branch for
+            // the first file that has any; do likewise.
+            if (!to->dummy || to->tag_files == to->tag_files_end) {
+                for (version_t ** k = from->tag_files;
+                     k != from->tag_files_end; ++k)
+                    ARRAY_APPEND (to->tag_files, *k);
+                if (from->changeset.time > to->changeset.time)
+                    to->changeset.time = from->changeset.time;
+            }
+            free (from->tag_files);
+        }
+
+        for (file_t * j = i->db.files; j != i->db.files_end; ++j) {
+            for (version_t * k = j->versions; k != j->versions_end; ++k) {
+                tag_hash_item_t * h = string_hash_find (&tags, k->branch->tag);
+                assert (h);
+                k->branch = &h->tag;
+            }
+            ARRAY_APPEND (db->files, *j);
+        }
+
+        free (i->db.files);
+        heap_destroy (&i->db.ready_changesets);
+        string_hash_destroy (&i->tags);
+    }
+
+    free (shards);
+
+    finish_database (db, &tags);
+}
+
+
+/// Send the rlog request for the whole of @c shard.
+static void send_rlog_shard (shard_t * shard, cvs_connection_t * s)
+{
+    cvs_printff (s, "Argument --\n");
+    if (shard->path != NULL)
+        cvs_printff (s, "Argument %s/%s\n", s->module, shard->path);
+    else if (shard->top_only)
+        cvs_printff (s, "Argument -l\nArgument %s\n", s->module);
+    else
+        cvs_printff (s, "Argument %s\n", s->module);
+    cvs_printff (s, "rlog\n");
+}
+
+
+/// An rlog'd file, indexed by ,v path.
+typedef struct raw_index {
+    string_hash_head_t head;
+    raw_file_t * raw;
+    bool done;
+} raw_index_t;
+
+
+/// List the files of @c shard by a header-only rlog, for @ref
+/// read_rlog_changed.
+static void list_rlog_headers (shard_t * shard, cvs_connection_t * s)
+{
+    cvs_printff (s, "Argument -h\n");
+    send_rlog_shard (shard, s);
+
+    next_line (s);
+    while (strcmp (s->line, "ok") != 0) {
+        if (strcmp (s->line, "M ") == 0) {
+            next_line (s);
+            continue;
+        }
+
+        rlog_header_t h;
+        read_file_header (&shard->tags, s, &h);
+        while (strcmp (s->line, FILE_BOUNDARY) != 0) {
+            if (!starts_with (s->line, "M "))
+                fatal ("Log (%s) header incorrectly terminated\n",
+                       h.rcs_path);
+            next_line (s);
+        }
+        next_line (s);
+
+        ARRAY_EXTEND (shard->listed);
+        listed_file_t * l = &shard->listed_end[-1];
+        l->rcs_path = h.rcs_path;
+        l->path = h.path;
+        l->attic = h.attic;
+        l->stamp = h.stamp;
+        l->record = snapshot_find (shard->snapshot, h.rcs_path, h.stamp);
+        l->tags = h.tags;
+        l->tags_end = h.tags_end;
+    }
+}
+
+
+/// Read @c shard, running rlog over only the files that have changed since the
+/// snapshot, and taking the rest from the snapshot.  In a local repository we
+/// walk the ,v files and compare their stat.  Otherwise, a header-only rlog
+/// gives each file's head and revision count to compare, and its current tags,
+/// so that tagging does not count as a change.
+static void read_rlog_changed (shard_t * shard, cvs_connection_t * s)
+{
+    if (s->local)
+        walk_shard (shard, visit_local_file, s->prefix);
+    else
+        list_rlog_headers (shard, s);
+
+    size_t changed = 0;
+    for (listed_file_t * i = shard->listed; i != shard->listed_end; ++i)
+        changed += i->record == NULL;
+
+    // If much has changed, one rlog of the whole shard is cheaper than naming
+    // the files.
+    bool whole = changed * 2 > (size_t) (shard->listed_end - shard->listed);
+    if (whole) {
+        send_rlog_shard (shard, s);
+        read_rlog (shard, s, true);
+    }
+    else if (changed != 0) {
+        cvs_printff (s, "Argument --\n");
+        for (listed_file_t * i = shard->listed; i != shard->listed_end; ++i)
+            if (i->record == NULL)
+                cvs_printff (s, "Argument %s/%s\n", s->module, i->path);
+        cvs_printff (s, "rlog\n");
+        read_rlog (shard, s, true);
+    }
+
+    string_hash_t index;
+    string_hash_init (&index);
+    for (raw_file_t * i = shard->raws; i != shard->raws_end; ++i) {
+        bool n;
+        raw_index_t * r = string_hash_insert (
+            &index, shard->db.files[i->index].rcs_path,
+            sizeof (raw_index_t), &n);
+        r->raw = i;
+        r->done = false;
+    }
+
+    // Fill in the files in the order of the listing, which is the order a full
+    // rlog would have given.
+    for (listed_file_t * i = shard->listed; i != shard->listed_end; ++i) {
+        if (!whole && i->record != NULL) {
+            raw_file_t raw;
+            load_file (&shard->db, &shard->tags, i->record, i->path, i->attic,
+                       i->tags, i->tags_end, &raw);
+            if (i->tags == NULL)
+                snapshot_copy_record (shard->records, i->record);
+            else
+                record_file (shard->records, &shard->db, &raw, i->stamp);
+            finish_file (&shard->db, &shard->tags, &raw);
+            continue;
+        }
+
+        xfree (i->tags);
+        raw_index_t * r = string_hash_find (&index, i->rcs_path);
+        if (r == NULL || r->done)
+            continue;                   // Vanished since the listing.
+
+        record_file (shard->records, &shard->db, r->raw, i->stamp);
+        finish_file (&shard->db, &shard->tags, r->raw);
+        r->done = true;
+    }
+
+    // Anything rlog found that the listing did not; we have no stamp for
+    // these, so they are not recorded.
+    for (raw_file_t * i = shard->raws; i != shard->raws_end; ++i) {
+        raw_index_t * r = string_hash_find (
+            &index, shard->db.files[i->index].rcs_path);
+        if (!r->done)
+            finish_file (&shard->db, &shard->tags, i);
+    }
+
+    if (s->local)
+        for (listed_file_t * i = shard->listed; i != shard->listed_end; ++i)
+            xfree (i->stamp);
+
+    string_hash_destroy (&index);
+    free (shard->raws);
+    free (shard->listed);
+}
+
+
+static void read_rlog_shard (shard_t * shard, void * context)
+{
+    cvs_connection_t * s = context;
+    // Listing a remote shard costs a header-only rlog; only worth it if
+    // there is a snapshot to take files from.
+    if (shard->records != NULL
+        && (s->local || shard->snapshot->records.num_entries != 0))
+        read_rlog_changed (shard, s);
+    else {
+        send_rlog_shard (shard, s);
+        read_rlog (shard, s, false);
+    }
+}
+
+
+void read_files_versions (database_t * db,
+                          cvs_connection_t * conns,
+                          cvs_connection_t * conns_end,
+                          const char * const * paths,
+                          const char * const * paths_end,
+                          const char * snapshot_path)
+{
+    // Without a list of paths, we can only find the top-level directories of
+    // a local repository.
+    bool split = conns->local && conns_end - conns > 1;
+
+    shard_t * shards_end;
+    shard_t * shards = make_shards (
+        conns->prefix, split, paths, paths_end, &shards_end);
+
+    // The stamps differ between local and remote access.
+    const char * key = xasprintf (
+        "rlog %s %s", conns->local ? "local" : "remote", conns->prefix);
+
+    read_shards (db, shards, shards_end, read_rlog_shard,
+                 conns, sizeof (cvs_connection_t), conns_end - conns,
+                 snapshot_path, key);
+    xfree (key);
+}
+
+
+static void read_rcs_shard (shard_t * shard, void * context)
+{
+    walk_shard (shard, visit_rcs_file, context);
+}
+
+
+void read_rcs_files_versions (database_t * db, const char * prefix,
+                              const char * const * paths,
+                              const char * const * paths_end,
+                              size_t threads, const char * snapshot_path)
+{
+    shard_t * shards_end;
+    shard_t * shards = make_shards (
+        prefix, threads > 1, paths, paths_end, &shards_end);
+
+    const char * key = xasprintf ("rcs %s", prefix);
+
+    // Every thread gets the same context, the prefix.
+    read_shards (db, shards, shards_end, read_rcs_shard,
+                 (void *) prefix, 0, threads, snapshot_path, key);
+    xfree (key);
 }
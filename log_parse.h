@@ -1,12 +1,35 @@
 #ifndef LOG_PARSE_H
 #define LOG_PARSE_H
 
+#include <stddef.h>
+
 struct database;
 struct cvs_connection;
 
-/// Populate @c database from the given file @c f.  @c l and @c l_len are used
-/// for storing lines as they are read fromthe file.
+/// Populate @c database by running rlog over the module, or over the list of
+/// @c paths within the module if that is non-empty.  The work is split into
+/// one shard per path (or, for a local repository, per top-level directory),
+/// and the shards are read in parallel over the connections [@c conns, @c
+/// conns_end).
+///
+/// If @c snapshot_path is not NULL and the repository is local, the files
+/// unchanged since the snapshot there was written are taken from it, only the
+/// changed files are rlog'd, and the snapshot is then rewritten.
 void read_files_versions (struct database * database,
-                          struct cvs_connection * s);
+                          struct cvs_connection * conns,
+                          struct cvs_connection * conns_end,
+                          const char * const * paths,
+                          const char * const * paths_end,
+                          const char * snapshot_path);
+
+/// Populate @c database by parsing the ,v files directly.  @c prefix is the
+/// path of the module directory, ending in a '/'.  If the list of @c paths
+/// within the module is empty, the whole module is read.  Up to @c threads
+/// threads are used, sharding as for @ref read_files_versions, and the
+/// snapshot at @c snapshot_path (if not NULL) is used likewise.
+void read_rcs_files_versions (struct database * database, const char * prefix,
+                              const char * const * paths,
+                              const char * const * paths_end,
+                              size_t threads, const char * snapshot_path);
 
 #endif
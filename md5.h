@@ -0,0 +1,9 @@
+#ifndef MD5_H
+#define MD5_H
+
+#include <stddef.h>
+
+/// Compute the MD5 digest of @c len bytes at @c data.
+void md5 (const void * data, size_t len, unsigned char digest[16]);
+
+#endif
@@ -0,0 +1,564 @@
+#include "log.h"
+#include "rcs.h"
+#include "utils.h"
+
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+typedef enum token_type {
+    tok_eof,
+    tok_word,                           ///< An id, num or sym.
+    tok_string,                         ///< An @-string.
+    tok_colon,
+    tok_semi,
+} token_type_t;
+
+typedef struct lexer {
+    const rcs_file_t * file;
+    const char * p;
+    const char * end;
+    token_type_t type;
+    rcs_text_t text;
+} lexer_t;
+
+
+// Unlike isdigit, only ever ASCII.
+static inline bool is_digit (int x)
+{
+    return x >= '0' && x <= '9';
+}
+
+
+static inline bool is_space (int x)
+{
+    return x == ' ' || x == '\t' || x == '\n' || x == '\r'
+        || x == '\v' || x == '\f';
+}
+
+
+static inline bool text_is (rcs_text_t t, const char * s)
+{
+    return t.len == strlen (s) && memcmp (t.data, s, t.len) == 0;
+}
+
+
+static void next_token (lexer_t * l)
+{
+    while (l->p != l->end && is_space (*l->p))
+        ++l->p;
+
+    if (l->p == l->end) {
+        l->type = tok_eof;
+        l->text.data = l->p;
+        l->text.len = 0;
+        return;
+    }
+
+    const char * start = l->p;
+    switch (*l->p) {
+    case ';':
+        l->type = tok_semi;
+        ++l->p;
+        break;
+    case ':':
+        l->type = tok_colon;
+        ++l->p;
+        break;
+    case '@':
+        l->type = tok_string;
+        ++start;
+        for (const char * q = start;;) {
+            const char * at = memchr (q, '@', l->end - q);
+            if (at == NULL)
+                fatal ("%s: unterminated string\n", l->file->path);
+            if (at + 1 == l->end || at[1] != '@') {
+                l->text.data = start;
+                l->text.len = at - start;
+                l->p = at + 1;
+                return;
+            }
+            q = at + 2;
+        }
+    default:
+        l->type = tok_word;
+        while (l->p != l->end && !is_space (*l->p)
+               && *l->p != ';' && *l->p != ':' && *l->p != '@')
+            ++l->p;
+        break;
+    }
+
+    l->text.data = start;
+    l->text.len = l->p - start;
+}
+
+
+static void expect (lexer_t * l, token_type_t type, const char * what)
+{
+    if (l->type != type)
+        fatal ("%s: expected %s at offset %zu\n", l->file->path, what,
+               (size_t) (l->text.data - l->file->data));
+}
+
+
+/// Skip the rest of a phrase, up to and including the ';'.
+static void skip_phrase (lexer_t * l)
+{
+    while (l->type != tok_semi) {
+        if (l->type == tok_eof)
+            fatal ("%s: unterminated phrase\n", l->file->path);
+        next_token (l);
+    }
+    next_token (l);
+}
+
+
+/// Is the current token a delta number?
+static bool at_num (const lexer_t * l)
+{
+    return l->type == tok_word && is_digit (l->text.data[0]);
+}
+
+
+static void parse_admin (rcs_file_t * f, lexer_t * l)
+{
+    while (l->type == tok_word && !at_num (l) && !text_is (l->text, "desc")) {
+        rcs_text_t key = l->text;
+        next_token (l);
+
+        if (text_is (key, "head") && l->type == tok_word) {
+            f->head = l->text;
+            next_token (l);
+        }
+        else if (text_is (key, "branch") && l->type == tok_word) {
+            f->branch = l->text;
+            next_token (l);
+        }
+        else if (text_is (key, "expand") && l->type == tok_string) {
+            f->expand = l->text;
+            next_token (l);
+        }
+        else if (text_is (key, "symbols"))
+            while (l->type == tok_word) {
+                rcs_symbol_t sym;
+                sym.name = l->text;
+                next_token (l);
+                expect (l, tok_colon, "':' in symbol");
+                next_token (l);
+                expect (l, tok_word, "symbol revision");
+                sym.num = l->text;
+                ARRAY_APPEND (f->symbols, sym);
+                next_token (l);
+            }
+
+        skip_phrase (l);
+    }
+}
+
+
+static void parse_delta (rcs_file_t * f, lexer_t * l)
+{
+    ARRAY_EXTEND (f->deltas);
+    rcs_delta_t * d = &f->deltas_end[-1];
+    memset (d, 0, sizeof (rcs_delta_t));
+    d->num = l->text;
+
+    next_token (l);
+    while (l->type == tok_word && !at_num (l) && !text_is (l->text, "desc")) {
+        rcs_text_t key = l->text;
+        next_token (l);
+
+        rcs_text_t * value = NULL;
+        if (text_is (key, "date"))
+            value = &d->date;
+        else if (text_is (key, "author"))
+            value = &d->author;
+        else if (text_is (key, "state"))
+            value = &d->state;
+        else if (text_is (key, "next"))
+            value = &d->next;
+        else if (text_is (key, "commitid"))
+            value = &d->commitid;
+        else if (text_is (key, "branches"))
+            while (l->type == tok_word) {
+                ARRAY_APPEND (d->branches, l->text);
+                next_token (l);
+            }
+
+        if (value != NULL && l->type == tok_word) {
+            *value = l->text;
+            next_token (l);
+        }
+
+        skip_phrase (l);
+    }
+
+    if (d->date.len == 0 || d->author.len == 0)
+        fatal ("%s: delta %.*s has no date or author\n",
+               f->path, (int) d->num.len, d->num.data);
+}
+
+
+static int compare_text (rcs_text_t A, rcs_text_t B)
+{
+    int c = memcmp (A.data, B.data, A.len < B.len ? A.len : B.len);
+    if (c != 0)
+        return c;
+    return A.len < B.len ? -1 : A.len > B.len;
+}
+
+
+static int compare_delta (const void * AA, const void * BB)
+{
+    return compare_text (((const rcs_delta_t *) AA)->num,
+                         ((const rcs_delta_t *) BB)->num);
+}
+
+
+rcs_delta_t * rcs_find_delta (const rcs_file_t * f, const char * num,
+                              size_t len)
+{
+    rcs_text_t key = { num, len };
+    rcs_delta_t * base = f->deltas;
+    size_t count = f->deltas_end - f->deltas;
+
+    while (count > 0) {
+        size_t mid = count >> 1;
+        int c = compare_text (base[mid].num, key);
+        if (c == 0)
+            return base + mid;
+        if (c < 0) {
+            base += mid + 1;
+            count -= mid + 1;
+        }
+        else
+            count = mid;
+    }
+
+    return NULL;
+}
+
+
+static void parse_deltatext (rcs_file_t * f, lexer_t * l)
+{
+    rcs_delta_t * d = rcs_find_delta (f, l->text.data, l->text.len);
+    if (d == NULL)
+        fatal ("%s: delta text for unknown revision %.*s\n",
+               f->path, (int) l->text.len, l->text.data);
+
+    next_token (l);
+    if (l->type != tok_word || !text_is (l->text, "log"))
+        fatal ("%s: revision %.*s has no log\n",
+               f->path, (int) d->num.len, d->num.data);
+    next_token (l);
+    expect (l, tok_string, "log string");
+    d->log = l->text;
+    next_token (l);
+
+    // Skip any newphrases.
+    while (l->type == tok_word && !text_is (l->text, "text"))
+        skip_phrase (l);
+
+    if (l->type != tok_word)
+        fatal ("%s: revision %.*s has no text\n",
+               f->path, (int) d->num.len, d->num.data);
+    next_token (l);
+    expect (l, tok_string, "text string");
+    d->text = l->text;
+    next_token (l);
+}
+
+
+void rcs_open (rcs_file_t * f, const char * path)
+{
+    memset (f, 0, sizeof (rcs_file_t));
+    f->path = path;
+
+    int fd = check (open (path, O_RDONLY | O_CLOEXEC), "open %s", path);
+    struct stat st;
+    check (fstat (fd, &st), "stat %s", path);
+    if (st.st_size == 0)
+        fatal ("%s: empty RCS file\n", path);
+
+    f->size = st.st_size;
+    f->mode = st.st_mode;
+    f->data = mmap (NULL, f->size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (f->data == MAP_FAILED)
+        fatal ("mmap %s failed: %m\n", path);
+    close (fd);
+
+    lexer_t l = { f, f->data, f->data + f->size, tok_eof, { NULL, 0 } };
+    next_token (&l);
+
+    parse_admin (f, &l);
+
+    while (at_num (&l))
+        parse_delta (f, &l);
+
+    if (l.type != tok_word || !text_is (l.text, "desc"))
+        fatal ("%s: missing desc\n", path);
+    next_token (&l);
+    expect (&l, tok_string, "desc string");
+    next_token (&l);
+
+    ARRAY_SORT (f->deltas, compare_delta);
+
+    while (at_num (&l))
+        parse_deltatext (f, &l);
+
+    if (l.type != tok_eof)
+        fatal ("%s: junk at offset %zu\n",
+               path, (size_t) (l.text.data - f->data));
+}
+
+
+void rcs_close (rcs_file_t * f)
+{
+    for (rcs_delta_t * d = f->deltas; d != f->deltas_end; ++d)
+        xfree (d->branches);
+    xfree (f->deltas);
+    xfree (f->symbols);
+
+    for (char ** i = f->buffers; i != f->buffers_end; ++i)
+        xfree (*i);
+    xfree (f->buffers);
+
+    munmap ((void *) f->data, f->size);
+}
+
+
+bool rcs_parse_date (time_t * time, rcs_text_t date)
+{
+    unsigned long field[6];
+    const char * p = date.data;
+    const char * end = date.data + date.len;
+    for (int i = 0; i != 6; ++i) {
+        if (p == end || !is_digit (*p))
+            return false;
+        field[i] = 0;
+        for (; p != end && is_digit (*p); ++p)
+            field[i] = field[i] * 10 + *p - '0';
+        if (i != 5 && (p == end || *p++ != '.'))
+            return false;
+    }
+    if (p != end)
+        return false;
+
+    struct tm dtm;
+    memset (&dtm, 0, sizeof dtm);
+    // Two digit years are 19xx.
+    dtm.tm_year = field[0] < 100 ? field[0] : field[0] - 1900;
+    dtm.tm_mon = field[1] - 1;
+    dtm.tm_mday = field[2];
+    dtm.tm_hour = field[3];
+    dtm.tm_min = field[4];
+    dtm.tm_sec = field[5];
+    if (dtm.tm_mon < 0 || dtm.tm_mon > 11 || dtm.tm_mday < 1
+        || dtm.tm_mday > 31 || dtm.tm_hour > 24 || dtm.tm_min > 59
+        || dtm.tm_sec > 60)
+        return false;
+
+    *time = timegm (&dtm);
+    return true;
+}
+
+
+char * rcs_text_copy (rcs_text_t text, size_t * len)
+{
+    char * result = xmalloc (text.len + 1);
+    char * q = result;
+    for (const char * p = text.data; p != text.data + text.len; ++p) {
+        *q++ = *p;
+        if (*p == '@')
+            ++p;                        // Skip the second '@' of a pair.
+    }
+    *q = 0;
+    if (len)
+        *len = q - result;
+    return result;
+}
+
+
+/// Return an unescaped version of @c text, owned by @c f.
+static const char * unescape (rcs_file_t * f, rcs_text_t text, size_t * len)
+{
+    if (memchr (text.data, '@', text.len) == NULL) {
+        *len = text.len;
+        return text.data;
+    }
+
+    char * copy = rcs_text_copy (text, len);
+    ARRAY_APPEND (f->buffers, copy);
+    return copy;
+}
+
+
+rcs_line_t * rcs_split_lines (const char * text, size_t len, rcs_line_t ** end)
+{
+    rcs_line_t * lines = NULL;
+    rcs_line_t * lines_end = NULL;
+    const char * p = text;
+    const char * text_end = text + len;
+    while (p != text_end) {
+        const char * nl = memchr (p, '\n', text_end - p);
+        const char * e = nl ? nl + 1 : text_end;
+        ARRAY_APPEND (lines, ((rcs_line_t) { p, e - p }));
+        p = e;
+    }
+    *end = lines_end;
+    return lines;
+}
+
+
+static bool parse_number (const char ** p, const char * end, size_t * n)
+{
+    if (*p == end || !is_digit (**p))
+        return false;
+    *n = 0;
+    for (; *p != end && is_digit (**p); ++*p)
+        *n = *n * 10 + **p - '0';
+    return true;
+}
+
+
+rcs_line_t * rcs_apply_edit (const rcs_line_t * old, const rcs_line_t * old_end,
+                             const char * script, size_t script_len,
+                             rcs_line_t ** end)
+{
+    size_t old_count = old_end - old;
+    // Pre-size for the common case of a small edit.
+    size_t max = old_count + 16;
+    rcs_line_t * lines = ARRAY_ALLOC (rcs_line_t, max);
+    size_t count = 0;
+    size_t done = 0;                    // Number of old lines consumed.
+
+    const char * p = script;
+    const char * script_end = script + script_len;
+    while (p != script_end) {
+        char command = *p++;
+        size_t line;
+        size_t n;
+        if ((command != 'a' && command != 'd')
+            || !parse_number (&p, script_end, &line)
+            || p == script_end || *p++ != ' '
+            || !parse_number (&p, script_end, &n))
+            goto bad;
+        if (p != script_end && *p++ != '\n')
+            goto bad;
+
+        // For a delete, the lines before @c line are kept; for an add, the
+        // lines up to and including @c line.
+        size_t keep = command == 'd' ? line - 1 : line;
+        if ((command == 'd' && line == 0) || keep < done
+            || keep > old_count || (command == 'd' && keep + n > old_count))
+            goto bad;
+
+        size_t added = command == 'a' ? n : 0;
+        if (count + keep - done + added > max) {
+            max = (count + keep - done + added) * 2;
+            lines = ARRAY_REALLOC (lines, max);
+        }
+        memcpy (lines + count, old + done, (keep - done) * sizeof (rcs_line_t));
+        count += keep - done;
+        done = keep;
+
+        if (command == 'd') {
+            done += n;
+            continue;
+        }
+
+        for (size_t i = 0; i != n; ++i) {
+            if (p == script_end)
+                goto bad;
+            const char * nl = memchr (p, '\n', script_end - p);
+            const char * e = nl ? nl + 1 : script_end;
+            lines[count].text = p;
+            lines[count].len = e - p;
+            ++count;
+            p = e;
+        }
+    }
+
+    if (count + old_count - done > max)
+        lines = ARRAY_REALLOC (lines, count + old_count - done);
+    memcpy (lines + count, old + done, (old_count - done) * sizeof (rcs_line_t));
+    count += old_count - done;
+
+    *end = lines + count;
+    return lines;
+
+bad:
+    xfree (lines);
+    return NULL;
+}
+
+
+/// Walk from the revision @c d, whose content is @c lines, along its chain of
+/// 'next' revisions, recursing into branches.  Takes ownership of @c lines.
+static void walk_chain (rcs_file_t * f, rcs_delta_t * d,
+                        rcs_line_t * lines, rcs_line_t * lines_end,
+                        rcs_revision_func * func, void * data)
+{
+    while (true) {
+        func (data, d, lines, lines_end);
+
+        for (rcs_text_t * b = d->branches; b != d->branches_end; ++b) {
+            rcs_delta_t * bd = rcs_find_delta (f, b->data, b->len);
+            if (bd == NULL)
+                fatal ("%s: missing branch revision %.*s\n",
+                       f->path, (int) b->len, b->data);
+            size_t len;
+            const char * script = unescape (f, bd->text, &len);
+            rcs_line_t * branch_end;
+            rcs_line_t * branch = rcs_apply_edit (lines, lines_end,
+                                                  script, len, &branch_end);
+            if (branch == NULL)
+                fatal ("%s: malformed delta for %.*s\n",
+                       f->path, (int) bd->num.len, bd->num.data);
+            walk_chain (f, bd, branch, branch_end, func, data);
+        }
+
+        if (d->next.len == 0)
+            break;
+
+        rcs_delta_t * nd = rcs_find_delta (f, d->next.data, d->next.len);
+        if (nd == NULL)
+            fatal ("%s: missing revision %.*s\n",
+                   f->path, (int) d->next.len, d->next.data);
+
+        size_t len;
+        const char * script = unescape (f, nd->text, &len);
+        rcs_line_t * next_end;
+        rcs_line_t * next = rcs_apply_edit (lines, lines_end,
+                                            script, len, &next_end);
+        if (next == NULL)
+            fatal ("%s: malformed delta for %.*s\n",
+                   f->path, (int) nd->num.len, nd->num.data);
+        xfree (lines);
+        lines = next;
+        lines_end = next_end;
+        d = nd;
+    }
+
+    xfree (lines);
+}
+
+
+void rcs_walk (rcs_file_t * f, rcs_revision_func * func, void * data)
+{
+    if (f->head.len == 0)
+        return;                         // No revisions at all.
+
+    rcs_delta_t * head = rcs_find_delta (f, f->head.data, f->head.len);
+    if (head == NULL)
+        fatal ("%s: missing head revision\n", f->path);
+
+    size_t len;
+    const char * text = unescape (f, head->text, &len);
+    rcs_line_t * lines_end;
+    rcs_line_t * lines = rcs_split_lines (text, len, &lines_end);
+    walk_chain (f, head, lines, lines_end, func, data);
+}
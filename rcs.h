@@ -0,0 +1,108 @@
+#ifndef RCS_H
+#define RCS_H
+
+/// @file
+/// Direct access to RCS ,v files, for local repositories.
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <sys/types.h>
+#include <time.h>
+
+/// A piece of an RCS file.  Strings are left in their @-escaped form.
+typedef struct rcs_text {
+    const char * data;
+    size_t len;
+} rcs_text_t;
+
+/// A line of a file revision; @c len includes any trailing newline.
+typedef struct rcs_line {
+    const char * text;
+    size_t len;
+} rcs_line_t;
+
+/// A symbolic name (tag or branch) from the admin section.
+typedef struct rcs_symbol {
+    rcs_text_t name;
+    rcs_text_t num;
+} rcs_symbol_t;
+
+/// A delta; the delta header plus the location of the delta text.
+typedef struct rcs_delta {
+    rcs_text_t num;
+    rcs_text_t date;
+    rcs_text_t author;
+    rcs_text_t state;
+    rcs_text_t commitid;                ///< Empty if none.
+    rcs_text_t next;                    ///< Empty if none.
+
+    rcs_text_t * branches;
+    rcs_text_t * branches_end;
+
+    rcs_text_t log;                     ///< Escaped log message.
+    rcs_text_t text;                    ///< Escaped text or edit script.
+} rcs_delta_t;
+
+typedef struct rcs_file {
+    const char * path;
+    const char * data;                  ///< The mmap'd file.
+    size_t size;
+    mode_t mode;                        ///< File permissions.
+
+    rcs_text_t head;
+    rcs_text_t branch;
+    rcs_text_t expand;                  ///< Default keyword mode; maybe empty.
+
+    rcs_symbol_t * symbols;
+    rcs_symbol_t * symbols_end;
+
+    /// Deltas, sorted by their number (as a string, not as a version).
+    rcs_delta_t * deltas;
+    rcs_delta_t * deltas_end;
+
+    /// Unescaped texts, kept until the file is closed.
+    char ** buffers;
+    char ** buffers_end;
+} rcs_file_t;
+
+/// Map the ,v file at @c path and parse it.
+void rcs_open (rcs_file_t * file, const char * path);
+
+/// Free the memory and mapping owned by @c file.
+void rcs_close (rcs_file_t * file);
+
+/// Find the delta with number @c num, or NULL.
+rcs_delta_t * rcs_find_delta (const rcs_file_t * file, const char * num,
+                              size_t len);
+
+/// Parse an RCS date (YY.MM.DD.hh.mm.ss or YYYY.MM.DD.hh.mm.ss).
+bool rcs_parse_date (time_t * time, rcs_text_t date);
+
+/// Return a malloc'd, nul-terminated, unescaped copy of @c text.  If @c len is
+/// not NULL, the length is stored there.
+char * rcs_text_copy (rcs_text_t text, size_t * len);
+
+/// Callback for @ref rcs_walk; the content of the revision @c delta is given
+/// by the lines [@c lines, @c lines_end).
+typedef void rcs_revision_func (void * data, const rcs_delta_t * delta,
+                                const rcs_line_t * lines,
+                                const rcs_line_t * lines_end);
+
+/// Reconstruct every revision of @c file, calling @c func for each.  The head
+/// is reconstructed first, then the reverse deltas are applied down the trunk,
+/// and the forward deltas along each branch.
+void rcs_walk (rcs_file_t * file, rcs_revision_func * func, void * data);
+
+/// Apply the RCS edit script @c script (unescaped) to the lines [@c old, @c
+/// old_end).  Returns a malloc'd line array, with the end stored in @c *end.
+/// The added lines point into @c script.  Returns NULL if the script is
+/// malformed.
+rcs_line_t * rcs_apply_edit (const rcs_line_t * old, const rcs_line_t * old_end,
+                             const char * script, size_t script_len,
+                             rcs_line_t ** end);
+
+/// Split @c len bytes at @c text into a malloc'd array of lines.
+rcs_line_t * rcs_split_lines (const char * text, size_t len,
+                              rcs_line_t ** end);
+
+#endif
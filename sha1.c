@@ -0,0 +1,120 @@
+#include "sha1.h"
+
+#include <stdio.h>
+#include <string.h>
+
+// A plain implementation of FIPS 180-1.  We use this to name blobs the way git
+// does, as they go past, so it needs to keep up with the CVS server but need
+// not be clever.
+
+static inline uint32_t rol (uint32_t x, int n)
+{
+    return (x << n) | (x >> (32 - n));
+}
+
+
+static void sha1_block (uint32_t h[5], const unsigned char * p)
+{
+    uint32_t w[80];
+    for (int i = 0; i != 16; ++i)
+        w[i] = (uint32_t) p[4 * i] << 24 | p[4 * i + 1] << 16
+            | p[4 * i + 2] << 8 | p[4 * i + 3];
+    for (int i = 16; i != 80; ++i)
+        w[i] = rol (w[i - 3] ^ w[i - 8] ^ w[i - 14] ^ w[i - 16], 1);
+
+    uint32_t a = h[0], b = h[1], c = h[2], d = h[3], e = h[4];
+    for (int i = 0; i != 80; ++i) {
+        uint32_t f;
+        uint32_t k;
+        if (i < 20) {
+            f = (b & c) | (~b & d);
+            k = 0x5a827999;
+        }
+        else if (i < 40) {
+            f = b ^ c ^ d;
+            k = 0x6ed9eba1;
+        }
+        else if (i < 60) {
+            f = (b & c) | (b & d) | (c & d);
+            k = 0x8f1bbcdc;
+        }
+        else {
+            f = b ^ c ^ d;
+            k = 0xca62c1d6;
+        }
+        uint32_t t = rol (a, 5) + f + e + k + w[i];
+        e = d;
+        d = c;
+        c = rol (b, 30);
+        b = a;
+        a = t;
+    }
+
+    h[0] += a;
+    h[1] += b;
+    h[2] += c;
+    h[3] += d;
+    h[4] += e;
+}
+
+
+void sha1_init (sha1_t * s)
+{
+    s->h[0] = 0x67452301;
+    s->h[1] = 0xefcdab89;
+    s->h[2] = 0x98badcfe;
+    s->h[3] = 0x10325476;
+    s->h[4] = 0xc3d2e1f0;
+    s->len = 0;
+}
+
+
+void sha1_update (sha1_t * s, const void * data, size_t len)
+{
+    const unsigned char * p = data;
+    size_t used = s->len & 63;
+    s->len += len;
+
+    if (used != 0) {
+        size_t n = 64 - used < len ? 64 - used : len;
+        memcpy (s->block + used, p, n);
+        p += n;
+        len -= n;
+        if (used + n != 64)
+            return;
+        sha1_block (s->h, s->block);
+    }
+
+    for (; len >= 64; len -= 64, p += 64)
+        sha1_block (s->h, p);
+
+    memcpy (s->block, p, len);
+}
+
+
+void sha1_final (sha1_t * s, unsigned char digest[20])
+{
+    // The remaining data, a 1 bit, padding, and the length in bits.
+    uint64_t bits = s->len * 8;
+    unsigned char pad[72];
+    size_t used = s->len & 63;
+    size_t pad_len = (used < 56 ? 56 : 120) - used;
+    memset (pad, 0, sizeof pad);
+    pad[0] = 0x80;
+    for (int i = 0; i != 8; ++i)
+        pad[pad_len + i] = bits >> (56 - 8 * i);
+    sha1_update (s, pad, pad_len + 8);
+
+    for (int i = 0; i != 5; ++i)
+        for (int j = 0; j != 4; ++j)
+            digest[4 * i + j] = s->h[i] >> (24 - 8 * j);
+}
+
+
+void sha1_blob_init (sha1_t * s, size_t len)
+{
+    char header[32];
+    int n = snprintf (header, sizeof header, "blob %zu", len);
+    sha1_init (s);
+    sha1_update (s, header, n + 1);
+}
@@ -0,0 +1,26 @@
+#ifndef SHA1_H
+#define SHA1_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/// An SHA-1 computation in progress.
+typedef struct sha1 {
+    uint32_t h[5];
+    uint64_t len;                       ///< Bytes so far.
+    unsigned char block[64];            ///< The partial block.
+} sha1_t;
+
+void sha1_init (sha1_t * s);
+
+/// Add @c len bytes at @c data to the digest.
+void sha1_update (sha1_t * s, const void * data, size_t len);
+
+/// Finish, putting the result in @c digest.
+void sha1_final (sha1_t * s, unsigned char digest[20]);
+
+/// Start the git blob SHA-1 of @c len bytes: the header "blob <len>\0".  The
+/// content then follows with @ref sha1_update.
+void sha1_blob_init (sha1_t * s, size_t len);
+
+#endif
@@ -0,0 +1,298 @@
+#include "log.h"
+#include "snapshot.h"
+#include "utils.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// The file is:
+//   magic, version, byte-order mark, key
+//   records: u64 length, then rcs path, stamp, payload
+//   magic again, so that a truncated file is detected.
+#define MAGIC "crapsnap"
+#define MAGIC_LEN 8
+#define FORMAT_VERSION 2
+#define BYTE_ORDER_MARK 0x01020304
+
+
+static void put_u32 (FILE * out, uint32_t v)
+{
+    fwrite (&v, sizeof v, 1, out);
+}
+
+
+void snapshot_put_int (FILE * out, int64_t value)
+{
+    fwrite (&value, sizeof value, 1, out);
+}
+
+
+void snapshot_put_string (FILE * out, const char * s, size_t len)
+{
+    put_u32 (out, len);
+    fwrite (s, len, 1, out);
+}
+
+
+/// Like the public get functions, but return false instead of dying.
+static bool get_bytes (snapshot_cursor_t * c, void * v, size_t len)
+{
+    if ((size_t) (c->end - c->p) < len)
+        return false;
+    memcpy (v, c->p, len);
+    c->p += len;
+    return true;
+}
+
+
+static bool get_string (snapshot_cursor_t * c, const char ** s, size_t * len)
+{
+    uint32_t l;
+    if (!get_bytes (c, &l, sizeof l) || (size_t) (c->end - c->p) < l)
+        return false;
+    *s = c->p;
+    *len = l;
+    c->p += l;
+    return true;
+}
+
+
+int64_t snapshot_get_int (snapshot_cursor_t * c)
+{
+    int64_t v;
+    if (!get_bytes (c, &v, sizeof v))
+        fatal ("Snapshot record for %s is truncated\n", c->rcs_path);
+    return v;
+}
+
+
+const char * snapshot_get_string (snapshot_cursor_t * c, size_t * len)
+{
+    const char * s;
+    if (!get_string (c, &s, len))
+        fatal ("Snapshot record for %s is truncated\n", c->rcs_path);
+    return s;
+}
+
+
+bool snapshot_try_int (snapshot_cursor_t * c, int64_t * value)
+{
+    return get_bytes (c, value, sizeof *value);
+}
+
+
+bool snapshot_try_string (snapshot_cursor_t * c)
+{
+    const char * s;
+    size_t len;
+    return get_string (c, &s, &len);
+}
+
+
+/// Index the records of the mapped file.  Returns false if it is malformed.
+/// Records whose payload fails @c check are left out.
+static bool index_records (snapshot_t * snap, const char * key,
+                           snapshot_check_func * check)
+{
+    snapshot_cursor_t c = { snap->map, (char *) snap->map + snap->size, NULL };
+    char magic[MAGIC_LEN];
+    uint32_t version;
+    uint32_t bom;
+    const char * k;
+    size_t key_len;
+    if (!get_bytes (&c, magic, MAGIC_LEN) || memcmp (magic, MAGIC, MAGIC_LEN)
+        || !get_bytes (&c, &version, sizeof version))
+        return false;
+
+    // A different format, or a different key (a different module), is not
+    // damage; start afresh quietly.
+    if (version != FORMAT_VERSION)
+        return true;
+
+    if (!get_bytes (&c, &bom, sizeof bom) || bom != BYTE_ORDER_MARK
+        || !get_string (&c, &k, &key_len))
+        return false;
+
+    if (key_len != strlen (key) || memcmp (k, key, key_len) != 0)
+        return true;
+
+    if (c.end - c.p < MAGIC_LEN
+        || memcmp (c.end - MAGIC_LEN, MAGIC, MAGIC_LEN) != 0)
+        return false;
+    c.end -= MAGIC_LEN;
+
+    while (c.p != c.end) {
+        uint64_t len;
+        if (!get_bytes (&c, &len, sizeof len)
+            || len > (uint64_t) (c.end - c.p))
+            return false;
+
+        snapshot_cursor_t r = { c.p, c.p + len, NULL };
+        const char * raw = c.p - sizeof len;
+        c.p += len;
+
+        const char * path;
+        size_t path_len;
+        const char * stamp;
+        size_t stamp_len;
+        if (!get_string (&r, &path, &path_len)
+            || !get_string (&r, &stamp, &stamp_len))
+            return false;
+
+        snapshot_cursor_t payload = { r.p, r.end, NULL };
+        if (check != NULL && !check (&payload)) {
+            warning ("Ignoring damaged snapshot record for %.*s\n",
+                     (int) path_len, path);
+            continue;
+        }
+
+        bool n;
+        snapshot_record_t * rec = string_hash_insert (
+            &snap->records, cache_string_n (path, path_len),
+            sizeof (snapshot_record_t), &n);
+        if (!n)
+            return false;
+
+        rec->stamp = stamp;
+        rec->stamp_len = stamp_len;
+        rec->data = r.p;
+        rec->data_end = r.end;
+        rec->raw = raw;
+        rec->raw_end = r.end;
+    }
+
+    return true;
+}
+
+
+bool snapshot_open (snapshot_t * snap, const char * path, const char * key,
+                    snapshot_check_func * check)
+{
+    snap->map = NULL;
+    snap->size = 0;
+    string_hash_init (&snap->records);
+
+    int fd = open (path, O_RDONLY);
+    if (fd < 0) {
+        if (errno != ENOENT)
+            warning ("Opening %s failed: %s\n", path, strerror (errno));
+        return false;
+    }
+
+    struct stat st;
+    if (fstat (fd, &st) != 0 || st.st_size == 0) {
+        close (fd);
+        return false;
+    }
+
+    snap->size = st.st_size;
+    snap->map = mmap (NULL, snap->size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close (fd);
+    if (snap->map == MAP_FAILED) {
+        warning ("mmap %s failed: %s\n", path, strerror (errno));
+        snap->map = NULL;
+        snap->size = 0;
+        return false;
+    }
+
+    if (!index_records (snap, key, check))
+        warning ("Ignoring damaged snapshot %s\n", path);
+    else if (snap->records.num_entries != 0)
+        return true;
+
+    snapshot_close (snap);
+    string_hash_init (&snap->records);
+    return false;
+}
+
+
+void snapshot_close (snapshot_t * snap)
+{
+    string_hash_destroy (&snap->records);
+    if (snap->map != NULL)
+        munmap (snap->map, snap->size);
+    snap->map = NULL;
+    snap->size = 0;
+}
+
+
+const snapshot_record_t * snapshot_find (const snapshot_t * snap,
+                                         const char * rcs_path,
+                                         const char * stamp)
+{
+    if (snap == NULL || snap->records.num_entries == 0)
+        return NULL;
+
+    const snapshot_record_t * rec = string_hash_find (&snap->records,
+                                                      rcs_path);
+    if (rec == NULL || rec->stamp_len != strlen (stamp)
+        || memcmp (rec->stamp, stamp, rec->stamp_len) != 0)
+        return NULL;
+
+    return rec;
+}
+
+
+void snapshot_put_record (FILE * out, const char * rcs_path,
+                          const char * stamp, const void * data, size_t len)
+{
+    size_t path_len = strlen (rcs_path);
+    size_t stamp_len = strlen (stamp);
+    uint64_t total = 2 * sizeof (uint32_t) + path_len + stamp_len + len;
+    fwrite (&total, sizeof total, 1, out);
+    snapshot_put_string (out, rcs_path, path_len);
+    snapshot_put_string (out, stamp, stamp_len);
+    fwrite (data, len, 1, out);
+}
+
+
+void snapshot_copy_record (FILE * out, const snapshot_record_t * rec)
+{
+    fwrite (rec->raw, rec->raw_end - rec->raw, 1, out);
+}
+
+
+void snapshot_write (const char * path, const char * key,
+                     char * const * data, const size_t * lens, size_t count)
+{
+    // Make sure the directory exists.
+    const char * slash = strrchr (path, '/');
+    if (slash != NULL) {
+        const char * dir = xasprintf ("%.*s", (int) (slash - path), path);
+        if (mkdir (dir, 0777) != 0 && errno != EEXIST)
+            warning ("Creating %s failed: %s\n", dir, strerror (errno));
+        xfree (dir);
+    }
+
+    const char * temp = xasprintf ("%s.new", path);
+    FILE * out = fopen (temp, "w");
+    if (out == NULL) {
+        warning ("Opening %s failed: %s\n", temp, strerror (errno));
+        xfree (temp);
+        return;
+    }
+
+    fwrite (MAGIC, MAGIC_LEN, 1, out);
+    put_u32 (out, FORMAT_VERSION);
+    put_u32 (out, BYTE_ORDER_MARK);
+    snapshot_put_string (out, key, strlen (key));
+    for (size_t i = 0; i != count; ++i)
+        fwrite (data[i], lens[i], 1, out);
+    fwrite (MAGIC, MAGIC_LEN, 1, out);
+
+    if (ferror (out) | (fclose (out) != 0)) {
+        warning ("Writing %s failed\n", temp);
+        unlink (temp);
+    }
+    else if (rename (temp, path) != 0) {
+        warning ("Renaming %s failed: %s\n", temp, strerror (errno));
+        unlink (temp);
+    }
+
+    xfree (temp);
+}
@@ -0,0 +1,95 @@
+#ifndef SNAPSHOT_H
+#define SNAPSHOT_H
+
+/// @file
+/// An on-disk snapshot of the per-file records parsed out of the repository,
+/// keyed by ,v file path, so that a later run need only re-read the ,v files
+/// that have changed.  Each record carries a stamp, a string that changes
+/// whenever the ,v file does: its size and mtime, or for a remote repository,
+/// the "head branch total" line built from its rlog header.  A remote stamp
+/// misses changes that leave those alone, such as cvs admin -m rewriting a log
+/// message or cvs admin -s changing a state.
+///
+/// The file is native-endian, and is validated and mapped as a whole.  The
+/// content of each record is up to the caller; this is just the container.
+
+#include "string_cache.h"
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+
+/// One record in a snapshot.
+typedef struct snapshot_record {
+    string_hash_head_t head;            ///< Keyed by the (cached) ,v path.
+    const char * stamp;                 ///< Not nul-terminated.
+    size_t stamp_len;
+    const char * data;                  ///< The caller's payload.
+    const char * data_end;
+    const char * raw;                   ///< The whole record, for copying.
+    const char * raw_end;
+} snapshot_record_t;
+
+/// A mapped snapshot.
+typedef struct snapshot {
+    void * map;
+    size_t size;
+    string_hash_t records;              ///< Of snapshot_record_t.
+} snapshot_t;
+
+/// A position in a record payload, for decoding.
+typedef struct snapshot_cursor {
+    const char * p;
+    const char * end;
+    const char * rcs_path;              ///< For error messages.
+} snapshot_cursor_t;
+
+/// Checks that a record payload is complete, returning false if not.
+typedef bool snapshot_check_func (snapshot_cursor_t * c);
+
+/// Map the snapshot at @c path, if it exists and was written with the same @c
+/// key.  Returns false (with a warning if the file is damaged) if there is no
+/// usable snapshot; @c snap is then empty, but still valid.  A record whose
+/// payload fails @c check is left out, with a warning, so that its file is
+/// read again.
+bool snapshot_open (snapshot_t * snap, const char * path, const char * key,
+                    snapshot_check_func * check);
+
+/// Release @c snap.
+void snapshot_close (snapshot_t * snap);
+
+/// Find the record for @c rcs_path, if it has the same @c stamp.
+const snapshot_record_t * snapshot_find (const snapshot_t * snap,
+                                         const char * rcs_path,
+                                         const char * stamp);
+
+/// Write a record for @c rcs_path, with @c stamp, and the @c len bytes of
+/// payload at @c data.
+void snapshot_put_record (FILE * out, const char * rcs_path,
+                          const char * stamp, const void * data, size_t len);
+
+/// Copy the record @c rec unchanged.
+void snapshot_copy_record (FILE * out, const snapshot_record_t * rec);
+
+/// Write the snapshot file @c path, with @c key, from the records in the @c
+/// count buffers @c data with lengths @c lens.  The file is written in place
+/// atomically.  Failure is not fatal, we just warn.
+void snapshot_write (const char * path, const char * key,
+                     char * const * data, const size_t * lens, size_t count);
+
+/// Payload encoding.  The put functions write to a stdio stream; the get
+/// functions die on a truncated record, which the check given to @ref
+/// snapshot_open should rule out.
+void snapshot_put_int (FILE * out, int64_t value);
+void snapshot_put_string (FILE * out, const char * s, size_t len);
+
+int64_t snapshot_get_int (snapshot_cursor_t * c);
+/// Returns a pointer into the mapping; the string is not nul-terminated.
+const char * snapshot_get_string (snapshot_cursor_t * c, size_t * len);
+
+/// As the get functions, but return false on a truncated record; for the
+/// check given to @ref snapshot_open.
+bool snapshot_try_int (snapshot_cursor_t * c, int64_t * value);
+bool snapshot_try_string (snapshot_cursor_t * c);
+
+#endif
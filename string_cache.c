@@ -4,6 +4,7 @@
 
 #include <assert.h>
 #include <math.h>
+#include <pthread.h>
 #include <stdlib.h>
 #include <string.h>
 
@@ -13,27 +14,39 @@ typedef struct string_entry {
     char data[1];                       // Actual data.
 } string_entry_t;
 
-static size_t cache_entries;
-static size_t cache_num_buckets;        // Always a power of 2.
-static string_entry_t ** cache_table;
+// The cache is split into independently locked stripes, selected by the low
+// bits of the hash, so that several threads can parse at once.
+#define STRIPE_BITS 6
+#define NUM_STRIPES (1 << STRIPE_BITS)
 
+typedef struct cache_stripe {
+    pthread_mutex_t lock;
+    size_t entries;
+    size_t num_buckets;                 // Always a power of 2.
+    string_entry_t ** table;
+} cache_stripe_t;
 
-static void cache_resize()
+static cache_stripe_t stripes[NUM_STRIPES] = {
+    [0 ... NUM_STRIPES - 1] = { .lock = PTHREAD_MUTEX_INITIALIZER }
+};
+
+
+static void cache_resize (cache_stripe_t * c)
 {
-    if (cache_num_buckets == 0) {
-        cache_num_buckets = 1024;       // Start with a reasonable size.
-        cache_table = ARRAY_CALLOC (string_entry_t *, cache_num_buckets);
+    if (c->num_buckets == 0) {
+        c->num_buckets = 16;            // Start with a reasonable size.
+        c->table = ARRAY_CALLOC (string_entry_t *, c->num_buckets);
         return;
     }
 
-    cache_table = ARRAY_REALLOC (cache_table, 2 * cache_num_buckets);
+    c->table = ARRAY_REALLOC (c->table, 2 * c->num_buckets);
 
-    for (size_t i = 0; i != cache_num_buckets; ++i) {
-        string_entry_t ** me = cache_table + i;
-        string_entry_t ** you = cache_table + cache_num_buckets + i;
+    for (size_t i = 0; i != c->num_buckets; ++i) {
+        string_entry_t ** me = c->table + i;
+        string_entry_t ** you = c->table + c->num_buckets + i;
         for (string_entry_t * p = *me; p; ) {
             string_entry_t * next = p->next;
-            if (p->hash & cache_num_buckets) {
+            if ((p->hash >> STRIPE_BITS) & c->num_buckets) {
                 *you = p;
                 you = &p->next;
             }
@@ -47,7 +60,13 @@ static void cache_resize()
         *you = NULL;
     }
 
-    cache_num_buckets *= 2;
+    c->num_buckets *= 2;
+}
+
+
+static string_entry_t ** cache_bucket (cache_stripe_t * c, unsigned long hash)
+{
+    return c->table + ((hash >> STRIPE_BITS) & (c->num_buckets - 1));
 }
 
 
@@ -56,27 +75,35 @@ const char * cache_string_n (const char * s, size_t len)
     assert (memchr (s, 0, len) == NULL);
 
     unsigned long hash = string_hash_func (s, len);
-    string_entry_t ** bucket = cache_table + (hash & (cache_num_buckets - 1));
-    if (cache_num_buckets)
-        for (; *bucket; bucket = &(*bucket)->next)
+    cache_stripe_t * c = &stripes[hash & (NUM_STRIPES - 1)];
+    pthread_mutex_lock (&c->lock);
+
+    string_entry_t ** bucket = NULL;
+    if (c->num_buckets)
+        for (bucket = cache_bucket (c, hash); *bucket;
+             bucket = &(*bucket)->next)
             if ((*bucket)->hash == hash
                 && strlen ((*bucket)->data) == len
-                && memcmp ((*bucket)->data, s, len) == 0)
+                && memcmp ((*bucket)->data, s, len) == 0) {
+                pthread_mutex_unlock (&c->lock);
                 return (*bucket)->data;
+            }
 
-    if (cache_entries >= cache_num_buckets) {
-        cache_resize();
-        for (bucket = cache_table + (hash & (cache_num_buckets - 1));
+    if (c->entries >= c->num_buckets) {
+        cache_resize (c);
+        for (bucket = cache_bucket (c, hash);
              *bucket; bucket = &(*bucket)->next);
     }
 
-    ++cache_entries;
+    ++c->entries;
     string_entry_t * b = xmalloc (offsetof (string_entry_t, data) + len + 1);
     *bucket = b;
     b->next = NULL;
     b->hash = hash;
     memcpy (b->data, s, len);
     b->data[len] = 0;
+
+    pthread_mutex_unlock (&c->lock);
     return b->data;
 }
 
@@ -103,36 +130,43 @@ const char * cache_stringf (const char * format, ...)
 
 void string_cache_stats (FILE * f)
 {
+    size_t entries = 0;
     size_t used = 0;
+    size_t buckets = 0;
     unsigned long long sumsq = 0;
-    for (size_t i = 0; i != cache_num_buckets; ++i) {
-        if (cache_table[i] == NULL)
-            continue;
-
-        ++used;
-        size_t len = 0;
-        for (string_entry_t * p = cache_table[i]; p; p = p->next)
-            ++len;
-
-        sumsq += len * (unsigned long long) len;
+    for (cache_stripe_t * c = stripes; c != stripes + NUM_STRIPES; ++c) {
+        entries += c->entries;
+        buckets += c->num_buckets;
+        for (size_t i = 0; i != c->num_buckets; ++i) {
+            if (c->table[i] == NULL)
+                continue;
+
+            ++used;
+            size_t len = 0;
+            for (string_entry_t * p = c->table[i]; p; p = p->next)
+                ++len;
+
+            sumsq += len * (unsigned long long) len;
+        }
     }
 
     fprintf (
         f, "String cache: %zu items, %zu/%zu buckets used, mean search %g\n",
-        cache_entries, used, cache_num_buckets,
-        sumsq / (double) cache_entries / 2 + 0.5);
+        entries, used, buckets, sumsq / (double) entries / 2 + 0.5);
 }
 
 
 void string_cache_destroy()
 {
-    for (size_t i = 0; i != cache_num_buckets; ++i)
-        for (string_entry_t * p = cache_table[i]; p; ) {
-            string_entry_t * prev = p;
-            p = p->next;
-            free (prev);
-        }
-    free (cache_table);
+    for (cache_stripe_t * c = stripes; c != stripes + NUM_STRIPES; ++c) {
+        for (size_t i = 0; i != c->num_buckets; ++i)
+            for (string_entry_t * p = c->table[i]; p; ) {
+                string_entry_t * prev = p;
+                p = p->next;
+                free (prev);
+            }
+        free (c->table);
+    }
 }
 
 
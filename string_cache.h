@@ -6,7 +6,7 @@
 #include <stdio.h>
 #include <string.h>
 
-/// Cache unique copy of a string.
+/// Cache unique copy of a string.  The cache functions are thread safe.
 const char * cache_string (const char * str);
 
 /// Cache unique copy of a string.
@@ -0,0 +1,773 @@
+#include "database.h"
+#include "file.h"
+#include "log.h"
+#include "utils.h"
+#include "version_cache.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pipeline.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// The file is:
+//   magic, version, byte-order mark, u64 length of the sorted section, u64
+//   length of the confirmed part of the log
+//   the sorted section: groups, in database order
+//   the log: groups, appended as blobs are sent.
+// A group is the versions of one file:
+//   u32 length of the rest, u32 path length, path and nul, u32 count
+//   count entries: u16 version length, version and nul, mode, raw SHA-1.
+// Mode is 'x' for executable, '-' otherwise.  Strings are nul-terminated so
+// that they can be used in place in the mapping.
+//
+// The log is confirmed at the end of a successful run.  Anything after that
+// is from a run that died, and is only used if git has the blob.
+#define MAGIC "crapvers"
+#define MAGIC_LEN 8
+#define FORMAT_VERSION 2
+#define BYTE_ORDER_MARK 0x01020304
+#define CONFIRMED_OFFSET (MAGIC_LEN + 2 * sizeof (uint32_t) + sizeof (uint64_t))
+#define HEADER_LEN (CONFIRMED_OFFSET + sizeof (uint64_t))
+
+/// Marks per chunk of a sha_table_t.
+#define CHUNK_BITS 12
+#define CHUNK_SIZE (1 << CHUNK_BITS)
+
+typedef struct cursor {
+    const char * p;
+    const char * end;
+} cursor_t;
+
+/// A group parsed out of the mapping.
+typedef struct group {
+    const char * path;
+    uint32_t count;
+    cursor_t entries;
+} group_t;
+
+/// An entry parsed out of a group.
+typedef struct entry {
+    const char * version;
+    char mode;
+    unsigned char sha[20];
+} entry_t;
+
+
+bool sha_from_hex (unsigned char sha[20], const char * hex)
+{
+    for (int i = 0; i != 40; ++i) {
+        int c = hex[i];
+        int d;
+        if (c >= '0' && c <= '9')
+            d = c - '0';
+        else if (c >= 'a' && c <= 'f')
+            d = c - 'a' + 10;
+        else
+            return false;
+        if (i & 1)
+            sha[i >> 1] = (sha[i >> 1] << 4) | d;
+        else
+            sha[i >> 1] = d;
+    }
+    return true;
+}
+
+
+void sha_to_hex (char hex[41], const unsigned char sha[20])
+{
+    static const char digits[] = "0123456789abcdef";
+    for (int i = 0; i != 20; ++i) {
+        hex[2 * i] = digits[sha[i] >> 4];
+        hex[2 * i + 1] = digits[sha[i] & 15];
+    }
+    hex[40] = 0;
+}
+
+
+static bool get_bytes (cursor_t * c, void * v, size_t len)
+{
+    if ((size_t) (c->end - c->p) < len)
+        return false;
+    memcpy (v, c->p, len);
+    c->p += len;
+    return true;
+}
+
+
+/// Get a nul-terminated string of @c len bytes, in place.
+static bool get_string (cursor_t * c, const char ** s, size_t len)
+{
+    if ((size_t) (c->end - c->p) <= len || c->p[len] != 0)
+        return false;
+    *s = c->p;
+    c->p += len + 1;
+    return true;
+}
+
+
+static bool get_group (cursor_t * c, group_t * g)
+{
+    uint32_t len;
+    uint32_t path_len;
+    if (!get_bytes (c, &len, sizeof len) || len > (size_t) (c->end - c->p))
+        return false;
+
+    cursor_t r = { c->p, c->p + len };
+    c->p += len;
+    if (!get_bytes (&r, &path_len, sizeof path_len)
+        || !get_string (&r, &g->path, path_len)
+        || !get_bytes (&r, &g->count, sizeof g->count))
+        return false;
+
+    g->entries = r;
+    return true;
+}
+
+
+static bool get_entry (group_t * g, entry_t * e)
+{
+    uint16_t len;
+    return get_bytes (&g->entries, &len, sizeof len)
+        && get_string (&g->entries, &e->version, len)
+        && get_bytes (&g->entries, &e->mode, 1)
+        && get_bytes (&g->entries, e->sha, sizeof e->sha);
+}
+
+
+static size_t blob_hash (const unsigned char sha[20])
+{
+    size_t h;
+    memcpy (&h, sha, sizeof h);
+    return h;
+}
+
+
+/// Add @c mark to the index of blobs by SHA-1.
+static void index_blob (version_cache_t * vc, size_t mark,
+                        const unsigned char sha[20])
+{
+    if (vc->num_blobs * 2 >= vc->blobs_size) {
+        size_t * old = vc->blobs;
+        size_t old_size = vc->blobs_size;
+        vc->blobs_size = old_size ? old_size * 2 : 1024;
+        vc->blobs = ARRAY_CALLOC (size_t, vc->blobs_size);
+        vc->num_blobs = 0;
+        for (size_t i = 0; i != old_size; ++i)
+            if (old[i] != 0)
+                index_blob (vc, old[i], sha_table_get (&vc->shas, old[i]));
+        xfree (old);
+    }
+
+    size_t i = blob_hash (sha) & (vc->blobs_size - 1);
+    while (vc->blobs[i] != 0) {
+        if (memcmp (sha_table_get (&vc->shas, vc->blobs[i]), sha, 20) == 0)
+            return;                     // Keep the first.
+        i = (i + 1) & (vc->blobs_size - 1);
+    }
+    vc->blobs[i] = mark;
+    ++vc->num_blobs;
+}
+
+
+size_t version_cache_find_blob (const version_cache_t * vc,
+                                const unsigned char sha[20])
+{
+    if (vc->blobs_size == 0)
+        return 0;
+    for (size_t i = blob_hash (sha) & (vc->blobs_size - 1); vc->blobs[i] != 0;
+         i = (i + 1) & (vc->blobs_size - 1))
+        if (memcmp (sha_table_get (&vc->shas, vc->blobs[i]), sha, 20) == 0)
+            return vc->blobs[i];
+    return 0;
+}
+
+
+/// Give @c v a mark for the cached blob @c sha.
+static void assign_mark (version_cache_t * vc, version_t * v, char mode,
+                         const unsigned char sha[20],
+                         FILE * marks, size_t * mark_counter)
+{
+    char hex[41];
+    sha_to_hex (hex, sha);
+    v->mark = ++*mark_counter;
+    v->exec = mode == 'x';
+    sha_table_set (&vc->shas, v->mark, sha);
+    index_blob (vc, v->mark, sha);
+    fprintf (marks, ":%zu %s\n", v->mark, hex);
+}
+
+
+/// Give a mark to the versions of @c f in group @c g.  If @c sorted, the
+/// group is in the same order as the versions of @c f, and we merge the two.
+/// If @c present is not NULL, it says which entries may be used, and is
+/// advanced past the group.
+static bool read_entries (version_cache_t * vc, group_t * g, const file_t * f,
+                          bool sorted, const bool ** present,
+                          FILE * marks, size_t * mark_counter)
+{
+    version_t * v = f ? f->versions : NULL;
+    for (uint32_t i = 0; i != g->count; ++i) {
+        entry_t e;
+        if (!get_entry (g, &e))
+            return false;
+
+        bool use = present == NULL || *(*present)++;
+        if (f == NULL || !use)
+            continue;
+
+        version_t * found;
+        if (sorted) {
+            while (v != f->versions_end && strverscmp (v->version, e.version) < 0)
+                ++v;
+            found = v != f->versions_end && strcmp (v->version, e.version) == 0
+                ? v : NULL;
+        }
+        else
+            found = file_find_version (f, e.version);
+
+        if (found != NULL)
+            assign_mark (vc, found, e.mode, e.sha, marks, mark_counter);
+    }
+    return true;
+}
+
+
+/// Ask git which of the blobs [@c shas, @c shas_end) it has.  Returns a
+/// malloc'd array of flags.
+static bool * check_blobs (const char * path, const unsigned char (* shas)[20],
+                           const unsigned char (* shas_end)[20])
+{
+    size_t count = shas_end - shas;
+    bool * present = ARRAY_CALLOC (bool, count);
+
+    const char * list_path = xasprintf ("%s.check", path);
+    FILE * list = fopen (list_path, "w");
+    if (list == NULL) {
+        warning ("opening %s failed: %s\n", list_path, strerror (errno));
+        xfree (list_path);
+        return present;
+    }
+    for (size_t i = 0; i != count; ++i) {
+        char hex[41];
+        sha_to_hex (hex, shas[i]);
+        fprintf (list, "%s\n", hex);
+    }
+    if (ferror (list) | (fclose (list) != 0)) {
+        warning ("writing %s failed\n", list_path);
+        unlink (list_path);
+        xfree (list_path);
+        return present;
+    }
+
+    pipeline * p = pipeline_new_command_args (
+        "git", "cat-file", "--batch-check", NULL);
+    pipeline_want_infile (p, list_path);
+    pipeline_want_out (p, -1);
+    pipeline_start (p);
+    FILE * answers = pipeline_get_outfile (p);
+
+    // One line per query: "<sha1> blob <size>", or "<sha1> missing".
+    char * line = NULL;
+    size_t line_max = 0;
+    for (size_t i = 0; i != count; ++i) {
+        if (getline (&line, &line_max, answers) <= 0)
+            break;
+        unsigned char sha[20];
+        present[i] = sha_from_hex (sha, line) && memcmp (sha, shas[i], 20) == 0
+            && starts_with (line + 40, " blob ");
+    }
+    xfree (line);
+
+    if (pipeline_wait (p) != 0)
+        memset (present, 0, count * sizeof (bool));
+    pipeline_free (p);
+
+    unlink (list_path);
+    xfree (list_path);
+    return present;
+}
+
+
+/// Read the binary cache mapped at [@c map, @c map + @c size).  Returns false
+/// if it is damaged.
+static bool load_binary (version_cache_t * vc, const char * map, size_t size,
+                         const database_t * db, FILE * marks,
+                         size_t * mark_counter)
+{
+    cursor_t c = { map, map + size };
+    char magic[MAGIC_LEN];
+    uint32_t version;
+    uint32_t bom;
+    uint64_t sorted_len;
+    uint64_t confirmed_len;
+    if (!get_bytes (&c, magic, MAGIC_LEN) || memcmp (magic, MAGIC, MAGIC_LEN)
+        || !get_bytes (&c, &version, sizeof version))
+        return false;
+
+    // A different format is not damage; start afresh quietly.
+    if (version != FORMAT_VERSION)
+        return true;
+
+    if (!get_bytes (&c, &bom, sizeof bom) || bom != BYTE_ORDER_MARK
+        || !get_bytes (&c, &sorted_len, sizeof sorted_len)
+        || !get_bytes (&c, &confirmed_len, sizeof confirmed_len)
+        || sorted_len > (uint64_t) (c.end - c.p)
+        || confirmed_len > (uint64_t) (c.end - c.p) - sorted_len)
+        return false;
+
+    // The sorted section is merge-joined against the database.  The marks go
+    // out in database order, so rewriting the cache later reads them in order.
+    cursor_t sorted = { c.p, c.p + sorted_len };
+    const file_t * f = db->files;
+    while (sorted.p != sorted.end) {
+        group_t g;
+        if (!get_group (&sorted, &g))
+            return false;
+        while (f != db->files_end && compare_paths (f->path, g.path) < 0)
+            ++f;
+        if (f != db->files_end && strcmp (f->path, g.path) == 0
+            && !read_entries (vc, &g, f, true, NULL, marks, mark_counter))
+            return false;
+    }
+    vc->sorted_len = sorted_len;
+
+    // The confirmed log is looked up item by item.
+    cursor_t log = { sorted.end, sorted.end + confirmed_len };
+    while (log.p != log.end) {
+        group_t g;
+        if (!get_group (&log, &g))
+            return false;
+        const file_t * lf = database_find_file (db, g.path);
+        if (lf != NULL
+            && !read_entries (vc, &g, lf, false, NULL, marks, mark_counter))
+            return false;
+    }
+    vc->log_len = confirmed_len;
+    vc->confirmed_len = confirmed_len;
+
+    // Once the log is a fair fraction of the whole, rewrite it sorted.
+    vc->compact = vc->log_len > vc->sorted_len / 4;
+
+    if (log.p == c.end)
+        return true;
+
+    // The rest is from a run that died, and may end with a partial group.
+    // Only blobs that made it into git are used, and then the whole is
+    // rewritten.
+    vc->compact = true;
+    cursor_t rest = { log.p, c.end };
+    unsigned char (* shas)[20] = NULL;
+    unsigned char (* shas_end)[20] = NULL;
+    while (rest.p != rest.end) {
+        group_t g;
+        entry_t e;
+        const char * start = rest.p;
+        if (!get_group (&rest, &g)) {
+            rest.end = start;
+            break;
+        }
+        for (uint32_t i = 0; i != g.count && get_entry (&g, &e); ++i) {
+            ARRAY_EXTEND (shas);
+            memcpy (shas_end[-1], e.sha, 20);
+        }
+    }
+
+    bool * present = vc->record
+        ? check_blobs (vc->path, shas, shas_end)
+        : ARRAY_CALLOC (bool, shas_end - shas);
+    const bool * p = present;
+    bool ok = true;
+    rest.p = log.p;
+    while (ok && rest.p != rest.end) {
+        group_t g;
+        get_group (&rest, &g);
+        ok = read_entries (vc, &g, database_find_file (db, g.path), false,
+                           &p, marks, mark_counter);
+    }
+
+    xfree (present);
+    xfree (shas);
+    return ok;
+}
+
+
+/// Read the old text format cache from @c cache.
+static void load_text (version_cache_t * vc, FILE * cache,
+                       const database_t * db, FILE * marks,
+                       size_t * mark_counter)
+{
+    char * line = NULL;
+    size_t line_max = 0;
+
+    while (true) {
+        char hex[41];
+        unsigned char sha[20];
+        char mode;
+        if (fscanf (cache, "%40[0-9a-f] %c", hex, &mode) < 2)
+            break;
+
+        if (mode != '-' && mode != 'x')
+            break;
+
+        ssize_t ll = getline (&line, &line_max, cache);
+        if (ll <= 0)
+            break;
+
+        if (strlen (hex) != 40 || !sha_from_hex (sha, hex))
+            continue;
+
+        if (line[ll - 1] == '\n')
+            line[ll - 1] = 0;
+
+        char * ver = line;
+        if (*ver == ' ')
+            ++ver;
+
+        char * path = strchr (ver, ' ');
+        if (path == NULL)
+            continue;
+
+        *path++ = 0;
+
+        // Attempt to find the path and version.
+        const file_t * f = database_find_file (db, path);
+        if (!f)
+            continue;
+
+        version_t * v = file_find_version (f, ver);
+        if (v)
+            assign_mark (vc, v, mode, sha, marks, mark_counter);
+    }
+
+    xfree (line);
+}
+
+
+/// Read the old text format cache at @c path, if it exists.
+static void load_text_path (version_cache_t * vc, const char * path,
+                            const database_t * db,
+                            FILE * marks, size_t * mark_counter)
+{
+    FILE * cache = fopen (path, "r");
+    if (cache == NULL) {
+        if (errno != ENOENT)
+            warning ("opening %s failed: %s\n", path, strerror (errno));
+        return;
+    }
+    load_text (vc, cache, db, marks, mark_counter);
+    fclose (cache);
+}
+
+
+static bool wanted (const version_cache_t * vc, const version_t * v)
+{
+    return !v->implicit_merge && v->mark > vc->first_mark
+        && v->mark != SIZE_MAX && sha_table_get (&vc->shas, v->mark) != NULL;
+}
+
+
+static void put_entry (FILE * out, const version_t * v,
+                       const unsigned char sha[20])
+{
+    uint16_t ver_len = strlen (v->version);
+    char mode = v->exec ? 'x' : '-';
+    fwrite (&ver_len, sizeof ver_len, 1, out);
+    fwrite (v->version, ver_len + 1, 1, out);
+    fwrite (&mode, 1, 1, out);
+    fwrite (sha, 20, 1, out);
+}
+
+
+static void put_group_header (FILE * out, const char * path,
+                              uint32_t count, uint32_t entries_len)
+{
+    uint32_t path_len = strlen (path);
+    uint32_t len = sizeof path_len + path_len + 1 + sizeof count + entries_len;
+    fwrite (&len, sizeof len, 1, out);
+    fwrite (&path_len, sizeof path_len, 1, out);
+    fwrite (path, path_len + 1, 1, out);
+    fwrite (&count, sizeof count, 1, out);
+}
+
+
+/// Write a group for the versions of @c f that we have a SHA-1 for.
+static void put_group (FILE * out, const version_cache_t * vc,
+                       const file_t * f)
+{
+    uint32_t count = 0;
+    uint32_t len = 0;
+    for (const version_t * v = f->versions; v != f->versions_end; ++v)
+        if (wanted (vc, v)) {
+            ++count;
+            len += sizeof (uint16_t) + strlen (v->version) + 1 + 1 + 20;
+        }
+
+    if (count == 0)
+        return;
+
+    put_group_header (out, f->path, count, len);
+    for (const version_t * v = f->versions; v != f->versions_end; ++v)
+        if (wanted (vc, v))
+            put_entry (out, v, sha_table_get (&vc->shas, v->mark));
+}
+
+
+/// Rewrite the whole cache, sorted, in place atomically.  Returns false on
+/// failure.
+static bool write_sorted (version_cache_t * vc, const database_t * db)
+{
+    const char * temp = xasprintf ("%s.new", vc->path);
+    FILE * out = fopen (temp, "w");
+    if (out == NULL) {
+        warning ("opening %s failed: %s\n", temp, strerror (errno));
+        xfree (temp);
+        return false;
+    }
+
+    uint32_t version = FORMAT_VERSION;
+    uint32_t bom = BYTE_ORDER_MARK;
+    uint64_t sorted_len = 0;
+    uint64_t confirmed_len = 0;
+    fwrite (MAGIC, MAGIC_LEN, 1, out);
+    fwrite (&version, sizeof version, 1, out);
+    fwrite (&bom, sizeof bom, 1, out);
+    fwrite (&sorted_len, sizeof sorted_len, 1, out);
+    fwrite (&confirmed_len, sizeof confirmed_len, 1, out);
+
+    for (const file_t * f = db->files; f != db->files_end; ++f)
+        put_group (out, vc, f);
+
+    // Now go back and fill in the length.
+    long end = ftell (out);
+    if (end >= (long) HEADER_LEN) {
+        sorted_len = end - HEADER_LEN;
+        fseek (out, CONFIRMED_OFFSET - sizeof sorted_len, SEEK_SET);
+        fwrite (&sorted_len, sizeof sorted_len, 1, out);
+    }
+
+    bool ok = false;
+    if (end < (long) HEADER_LEN || ferror (out) | (fclose (out) != 0)) {
+        warning ("writing %s failed\n", temp);
+        unlink (temp);
+    }
+    else if (rename (temp, vc->path) != 0) {
+        warning ("renaming %s failed: %s\n", temp, strerror (errno));
+        unlink (temp);
+    }
+    else {
+        ok = true;
+        vc->sorted_len = sorted_len;
+        vc->log_len = 0;
+        vc->confirmed_len = 0;
+        if (vc->legacy_path != NULL && strcmp (vc->legacy_path, vc->path))
+            // The text format cache is now superseded.
+            unlink (vc->legacy_path);
+    }
+
+    xfree (temp);
+    return ok;
+}
+
+
+void version_cache_load (version_cache_t * vc,
+                         const char * path, const char * legacy_path,
+                         bool record, const database_t * db, FILE * marks,
+                         size_t * mark_counter)
+{
+    vc->path = path;
+    vc->legacy_path = legacy_path;
+    vc->sorted_len = 0;
+    vc->log_len = 0;
+    vc->confirmed_len = 0;
+    vc->compact = true;
+    vc->record = record;
+    vc->first_mark = *mark_counter;
+    sha_table_init (&vc->shas);
+    vc->blobs = NULL;
+    vc->blobs_size = 0;
+    vc->num_blobs = 0;
+    vc->log = NULL;
+
+    int fd = open (path, O_RDONLY);
+    struct stat st;
+    if (fd < 0) {
+        if (errno != ENOENT)
+            warning ("opening %s failed: %s\n", path, strerror (errno));
+        else if (legacy_path != NULL)
+            load_text_path (vc, legacy_path, db, marks, mark_counter);
+    }
+    else if (fstat (fd, &st) != 0 || st.st_size == 0)
+        close (fd);
+    else {
+        size_t size = st.st_size;
+        void * map = mmap (NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+        close (fd);
+        if (map == MAP_FAILED)
+            fatal ("mmap %s failed: %s\n", path, strerror (errno));
+
+        if (size < MAGIC_LEN || memcmp (map, MAGIC, MAGIC_LEN) != 0)
+            load_text_path (vc, path, db, marks, mark_counter);
+        else if (!load_binary (vc, map, size, db, marks, mark_counter)) {
+            warning ("Ignoring the rest of damaged version cache %s\n", path);
+            vc->compact = true;
+        }
+
+        munmap (map, size);
+    }
+
+    if (!record)
+        return;
+
+    // Compact now, so that this run's log goes on the end of a clean file.
+    if (vc->compact && !write_sorted (vc, db))
+        return;
+
+    vc->log = fopen (path, "a");
+    if (vc->log == NULL)
+        warning ("opening %s failed: %s\n", path, strerror (errno));
+}
+
+
+void version_cache_add (version_cache_t * vc, const version_t * v,
+                        const unsigned char sha[20])
+{
+    sha_table_set (&vc->shas, v->mark, sha);
+    index_blob (vc, v->mark, sha);
+
+    if (vc->log == NULL || v->implicit_merge)
+        return;
+
+    put_group_header (vc->log, v->file->path, 1,
+                      sizeof (uint16_t) + strlen (v->version) + 1 + 1 + 20);
+    put_entry (vc->log, v, sha);
+}
+
+
+void version_cache_flush (version_cache_t * vc)
+{
+    if (vc->log != NULL && fflush (vc->log) != 0)
+        warning ("Writing %s failed: %s\n", vc->path, strerror (errno));
+}
+
+
+void version_cache_finish (version_cache_t * vc)
+{
+    if (vc->log != NULL) {
+        // Everything sent is now safely in git; confirm the log.  That needs
+        // a descriptor without O_APPEND, else pwrite appends.
+        long end = fflush (vc->log) == 0 ? ftell (vc->log) : -1;
+        bool ok = fclose (vc->log) == 0
+            && end >= (long) (HEADER_LEN + vc->sorted_len);
+        vc->log = NULL;
+        int fd = ok ? open (vc->path, O_WRONLY) : -1;
+        uint64_t confirmed_len = end - HEADER_LEN - vc->sorted_len;
+        ok = fd >= 0
+            && pwrite (fd, &confirmed_len, sizeof confirmed_len,
+                       CONFIRMED_OFFSET) == sizeof confirmed_len;
+        if (fd >= 0 && close (fd) != 0)
+            ok = false;
+        if (!ok)
+            warning ("writing %s failed\n", vc->path);
+    }
+
+    sha_table_destroy (&vc->shas);
+    xfree (vc->blobs);
+    vc->blobs = NULL;
+}
+
+
+void sha_table_init (sha_table_t * table)
+{
+    table->chunks = NULL;
+    table->num_chunks = 0;
+}
+
+
+void sha_table_destroy (sha_table_t * table)
+{
+    for (size_t i = 0; i != table->num_chunks; ++i)
+        xfree (table->chunks[i]);
+    xfree (table->chunks);
+}
+
+
+void sha_table_set (sha_table_t * table, size_t mark,
+                    const unsigned char sha[20])
+{
+    size_t c = mark >> CHUNK_BITS;
+    if (c >= table->num_chunks) {
+        size_t n = table->num_chunks ? table->num_chunks : 16;
+        while (n <= c)
+            n *= 2;
+        table->chunks = ARRAY_REALLOC (table->chunks, n);
+        memset (table->chunks + table->num_chunks, 0,
+                (n - table->num_chunks) * sizeof table->chunks[0]);
+        table->num_chunks = n;
+    }
+    if (table->chunks[c] == NULL)
+        table->chunks[c] = xcalloc (CHUNK_SIZE * 20);
+    memcpy (table->chunks[c][mark & (CHUNK_SIZE - 1)], sha, 20);
+}
+
+
+const unsigned char * sha_table_get (const sha_table_t * table, size_t mark)
+{
+    static const unsigned char zero[20];
+    size_t c = mark >> CHUNK_BITS;
+    if (c >= table->num_chunks || table->chunks[c] == NULL)
+        return NULL;
+    const unsigned char * sha = table->chunks[c][mark & (CHUNK_SIZE - 1)];
+    return memcmp (sha, zero, 20) != 0 ? sha : NULL;
+}
+
+
+bool sha_table_read_marks (sha_table_t * table, const char * path,
+                           bool (* wanted) (size_t mark))
+{
+    int fd = open (path, O_RDONLY);
+    struct stat st;
+    if (fd < 0 || fstat (fd, &st) != 0) {
+        warning ("opening %s failed: %s\n", path, strerror (errno));
+        if (fd >= 0)
+            close (fd);
+        return false;
+    }
+    if (st.st_size == 0) {
+        close (fd);
+        return true;
+    }
+
+    size_t size = st.st_size;
+    const char * map = mmap (NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close (fd);
+    if (map == MAP_FAILED) {
+        warning ("mmap %s failed: %s\n", path, strerror (errno));
+        return false;
+    }
+
+    // Lines are ":<mark> <sha1>", in increasing mark order.
+    const char * p = map;
+    const char * end = map + size;
+    while (p != end && *p == ':') {
+        size_t mark = 0;
+        for (++p; p != end && *p >= '0' && *p <= '9'; ++p)
+            mark = mark * 10 + *p - '0';
+        if (end - p < 41 || *p != ' ')
+            break;
+
+        unsigned char sha[20];
+        if (wanted (mark) && sha_from_hex (sha, p + 1))
+            sha_table_set (table, mark, sha);
+
+        const char * nl = memchr (p, '\n', end - p);
+        p = nl ? nl + 1 : end;
+    }
+
+    munmap ((void *) map, size);
+    return true;
+}
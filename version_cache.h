@@ -0,0 +1,96 @@
+#ifndef VERSION_CACHE_H
+#define VERSION_CACHE_H
+
+/// @file
+/// The version cache: the git blob SHA-1 of each file version already
+/// imported, so that a later run need not fetch it again.
+///
+/// The file is native-endian and mapped as a whole.  It starts with the
+/// versions sorted the same way as the database, path by path, so that it can
+/// be joined against the database in one linear pass.  After that comes a log,
+/// with each blob appended as it is sent, its SHA-1 computed locally; once the
+/// log grows large, the whole file is rewritten sorted.
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdio.h>
+
+struct database;
+struct version;
+
+/// A sparse map from mark to SHA-1, allocated a chunk at a time as marks are
+/// stored.
+typedef struct sha_table {
+    unsigned char (** chunks)[20];
+    size_t num_chunks;
+} sha_table_t;
+
+/// The state carried through a run.
+typedef struct version_cache {
+    const char * path;
+    const char * legacy_path;           ///< Old text format cache, or NULL.
+    size_t sorted_len;                  ///< Bytes in the sorted section.
+    size_t log_len;                     ///< Bytes in the log.
+    size_t confirmed_len;               ///< Bytes of the log known good.
+    bool compact;                       ///< Rewrite, rather than append?
+    bool record;                        ///< Are the blobs going into git?
+    size_t first_mark;                  ///< Marks after this are versions.
+    sha_table_t shas;                   ///< The SHA-1 of each version mark.
+    size_t * blobs;                     ///< Hash index of marks by SHA-1.
+    size_t blobs_size;
+    size_t num_blobs;
+    FILE * log;                         ///< Appending to the log, or NULL.
+} version_cache_t;
+
+/// Read the cache at @c path, giving each cached version in @c db a mark from
+/// @c mark_counter, and writing the marks for git fast-import to @c marks.  If
+/// @c path does not exist, the old text format file @c legacy_path (if not
+/// NULL) is read instead; @c path itself may also be in the text format.  If
+/// @c record, the blobs sent are going into git, and are logged to the cache
+/// as they are added.
+void version_cache_load (version_cache_t * vc,
+                         const char * path, const char * legacy_path,
+                         bool record, const struct database * db, FILE * marks,
+                         size_t * mark_counter);
+
+/// Find the mark of a blob, cached or already sent, with SHA-1 @c sha.
+/// Returns 0 if there is none.
+size_t version_cache_find_blob (const version_cache_t * vc,
+                                const unsigned char sha[20]);
+
+/// Note that @c v, with its mark set, has the blob @c sha.
+void version_cache_add (version_cache_t * vc, const struct version * v,
+                        const unsigned char sha[20]);
+
+/// Flush the log to the file, so that the blobs sent so far are checked and
+/// kept by the next run, even if this one dies.
+void version_cache_flush (version_cache_t * vc);
+
+/// Confirm the log, once git has everything sent, and release @c vc.  Failure
+/// is not fatal, we just warn.
+void version_cache_finish (version_cache_t * vc);
+
+void sha_table_init (sha_table_t * table);
+void sha_table_destroy (sha_table_t * table);
+
+/// Store @c sha for @c mark.
+void sha_table_set (sha_table_t * table, size_t mark,
+                    const unsigned char sha[20]);
+
+/// The SHA-1 for @c mark, or NULL if it is not known.
+const unsigned char * sha_table_get (const sha_table_t * table, size_t mark);
+
+/// Read the marks file written by git fast-import at @c path into @c table,
+/// keeping only the marks for which @c wanted returns true.  Returns false
+/// (with a warning) if the file cannot be read.
+bool sha_table_read_marks (sha_table_t * table, const char * path,
+                           bool (* wanted) (size_t mark));
+
+/// Convert the 40 hex digits at @c hex to a binary SHA-1.  Returns false if
+/// @c hex is not valid.
+bool sha_from_hex (unsigned char sha[20], const char * hex);
+
+/// Format @c sha as 40 hex digits and a nul.
+void sha_to_hex (char hex[41], const unsigned char sha[20]);
+
+#endif